@@ -143,6 +143,74 @@ block_write (struct block *block, block_sector_t sector, const void *buffer)
   block->write_cnt++;
 }
 
+/* Reads CNT sectors starting at SECTOR from BLOCK into BUFFER,
+   which must have room for CNT * BLOCK_SECTOR_SIZE bytes.  Drivers
+   that support it move up to BLOCK_MULTIPLE_MAX sectors in a
+   single command, others a sector at a time. */
+void
+block_read_multiple (struct block *block, block_sector_t sector,
+                     void *buffer_, block_sector_t cnt)
+{
+  uint8_t *buffer = buffer_;
+
+  if (cnt == 0)
+    return;
+  check_sector (block, sector);
+  check_sector (block, sector + cnt - 1);
+  while (cnt > 0)
+    {
+      block_sector_t n = cnt < BLOCK_MULTIPLE_MAX ? cnt : BLOCK_MULTIPLE_MAX;
+
+      if (block->ops->read_multiple != NULL)
+        block->ops->read_multiple (block->aux, sector, buffer, n);
+      else
+        {
+          block_sector_t i;
+          for (i = 0; i < n; i++)
+            block->ops->read (block->aux, sector + i,
+                              buffer + i * BLOCK_SECTOR_SIZE);
+        }
+      block->read_cnt += n;
+      sector += n;
+      buffer += n * BLOCK_SECTOR_SIZE;
+      cnt -= n;
+    }
+}
+
+/* Writes CNT sectors starting at SECTOR to BLOCK from BUFFER,
+   which must contain CNT * BLOCK_SECTOR_SIZE bytes.  Returns after
+   the block device has acknowledged receiving all of them. */
+void
+block_write_multiple (struct block *block, block_sector_t sector,
+                      const void *buffer_, block_sector_t cnt)
+{
+  const uint8_t *buffer = buffer_;
+
+  if (cnt == 0)
+    return;
+  check_sector (block, sector);
+  check_sector (block, sector + cnt - 1);
+  ASSERT (block->type != BLOCK_FOREIGN);
+  while (cnt > 0)
+    {
+      block_sector_t n = cnt < BLOCK_MULTIPLE_MAX ? cnt : BLOCK_MULTIPLE_MAX;
+
+      if (block->ops->write_multiple != NULL)
+        block->ops->write_multiple (block->aux, sector, buffer, n);
+      else
+        {
+          block_sector_t i;
+          for (i = 0; i < n; i++)
+            block->ops->write (block->aux, sector + i,
+                               buffer + i * BLOCK_SECTOR_SIZE);
+        }
+      block->write_cnt += n;
+      sector += n;
+      buffer += n * BLOCK_SECTOR_SIZE;
+      cnt -= n;
+    }
+}
+
 /* Returns the number of sectors in BLOCK. */
 block_sector_t
 block_size (struct block *block)
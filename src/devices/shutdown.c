@@ -11,6 +11,7 @@
 #endif
 #ifdef FILESYS
 #include "devices/block.h"
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #endif
 
@@ -31,6 +32,7 @@ shutdown (void)
   switch (how)
     {
     case SHUTDOWN_POWER_OFF:
+    case SHUTDOWN_CRASH:
       shutdown_power_off ();
       break;
 
@@ -83,7 +85,9 @@ shutdown_reboot (void)
 }
 
 /* Powers down the machine we're running on,
-   as long as we're running on Bochs or QEMU. */
+   as long as we're running on Bochs or QEMU.
+   The file system is written back first, unless shutdown_configure()
+   was told to crash. */
 void
 shutdown_power_off (void)
 {
@@ -91,7 +95,8 @@ shutdown_power_off (void)
   const char *p;
 
 #ifdef FILESYS
-  filesys_done ();
+  if (how != SHUTDOWN_CRASH)
+    filesys_done ();
 #endif
 
   print_stats ();
@@ -124,6 +129,7 @@ print_stats (void)
   thread_print_stats ();
 #ifdef FILESYS
   block_print_stats ();
+  cache_print_stats ();
 #endif
   console_print_stats ();
   kbd_print_stats ();
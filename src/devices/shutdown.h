@@ -9,6 +9,8 @@ enum shutdown_type
     SHUTDOWN_NONE,              /* Loop forever. */
     SHUTDOWN_POWER_OFF,         /* Power off the machine (if possible). */
     SHUTDOWN_REBOOT,            /* Reboot the machine (if possible). */
+    SHUTDOWN_CRASH,             /* Power off without writing back the
+                                   file system, as if it crashed. */
   };
 
 void shutdown (void);
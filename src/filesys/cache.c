@@ -2,32 +2,159 @@
 #include <stdio.h>
 #include <debug.h>
 #include <list.h>
+#include <hash.h>
+#include <stdlib.h>
 #include <string.h>
 #include <round.h>
 #include "devices/block.h"
 #include "devices/timer.h"
 #include "threads/thread.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
 #include "threads/synch.h"
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
 
-/* Structure for buffer cache */
+/* Default, smallest and largest number of cache entries */
+#define CACHE_SIZE 65
+#define CACHE_MIN 32
+#define CACHE_MAX 1024
+/* Range of the -flush-age option, in timer ticks */
+#define FLUSH_AGE_MIN 1
+#define FLUSH_AGE_MAX (60 * TIMER_FREQ)
+
+/* Number of cache entries, set by -cache */
+static int cache_size = CACHE_SIZE;
+
+/* Sector number of a cache entry that caches nothing */
+#define CACHE_NO_SECTOR ((block_sector_t) -1)
+
+/* Pages holding cache_size sectors of cached data */
+#define CACHE_PAGES DIV_ROUND_UP (cache_size * BLOCK_SECTOR_SIZE, PGSIZE)
+
+/* Structure for buffer cache, every slot in index order */
 static struct list cache;
-/* Queue for read-ahead, 성하야 언젠가 해보자 ^^*/
-//static struct list queue;
-//static struct lock q_lock;
-//static struct condition q_not_empty;
+/* Cache entry metadata, kept apart from the data in cache_arena */
+static struct cache_entry *cache_slots;
+/* Page-aligned data buffers, slot i owns the i-th sector */
+static uint8_t *cache_arena;
+/* Sector-keyed index over the entries in CACHE */
+static struct hash cache_map;
+/* Queue for read-ahead */
+static struct list queue;
+static struct lock q_lock;
+static struct condition q_not_empty;
+/* Set by cache_destroy () so that read_aheader stops */
+static bool q_closed;
 
-/* List element for saved victim */
+/* List element for saved victim, the hand of FIFO and clock */
 static struct list_elem *saved_victim;
+/* Discarded entries, reused before any policy victim */
+static struct list free_list;
+/* Recency list of LRU, and 2Q's Am queue */
+static struct list lru_list;
+/* 2Q's A1in queue of entries referenced only once */
+static struct list a1in_list;
+
+/* Dirty entries, oldest first, and their number. Protected by c_lock */
+static struct list dirty_list;
+static int dirty_cnt;
+/* Set by cache_destroy () so that flusher stops */
+static bool cache_closed;
+
+/* Entries pinned by cache_pin (), at most PIN_MAX of them so that
+   the rest of the cache stays available */
+#define PIN_MAX (cache_size / 4)
+static int pinned_cnt;
+/* Signaled when an entry becomes evictable, c_lock's condition */
+static struct condition c_evictable;
+
+/* Entries changed by the running journal transaction, which stay
+   in the cache until it commits, at most LOG_MAX of them. The
+   journal makes handles wait rather than log more. Protected by
+   c_lock */
+#define LOG_MAX (cache_size / 2 < JOURNAL_TXN_MAX \
+                 ? cache_size / 2 : JOURNAL_TXN_MAX)
+static int logged_cnt;
+
+/* Dirty entries older than this many ticks are written back by the
+   flusher. Set with the -flush-age kernel option. */
+static int64_t cache_flush_age = 3 * TIMER_FREQ;
 
+static unsigned cache_hash (const struct hash_elem *, void *);
+static bool cache_less (const struct hash_elem *, const struct hash_elem *,
+                        void *);
 static struct cache_entry *cache_find (block_sector_t);
-static struct cache_entry *cache_get_block (block_sector_t);
-//static void cache_read_ahead (block_sector_t sector);
-static struct cache_entry *cache_alloc (block_sector_t sector);
+static struct cache_entry *cache_get (block_sector_t, bool exclusive,
+                                      bool fill);
+static struct cache_entry *cache_get_block (block_sector_t, bool exclusive);
+static struct cache_entry *cache_get_new_block (block_sector_t);
+static void cache_release_block (struct cache_entry *, bool exclusive);
+static void cache_lock (struct cache_entry *, bool exclusive);
+static bool cache_try_lock (struct cache_entry *);
+static void cache_unlock (struct cache_entry *, bool exclusive);
+static void cache_prefetch (block_sector_t);
+static void cache_ahead_used (struct cache_entry *);
+static void cache_ahead_wasted (struct cache_entry *);
+static void q_destroy (void);
+static struct cache_entry *cache_alloc (block_sector_t sector, bool wait);
+static void cache_unuse (struct cache_entry *);
 static struct cache_entry *cache_evict (void);
+static bool cache_evictable (struct cache_entry *);
+static void cache_discard (struct cache_entry *);
+static void cache_mark_dirty (struct cache_entry *, block_sector_t owner);
+static void cache_set_dirty (struct cache_entry *, block_sector_t owner);
+static void cache_log (struct cache_entry *);
+static void cache_zero_data (block_sector_t, block_sector_t owner);
+static void cache_copy_logged (block_sector_t, void *);
+static void cache_clean (struct cache_entry *);
+static void cache_write_back (struct cache_entry *);
+static void cache_throttle (void);
+static block_sector_t cache_extent_find (const struct inode_disk *, size_t,
+                                         block_sector_t *cnt);
+struct extent_array;
+static void cache_extent_array (struct cache_entry *, bool inline_,
+                                struct extent_array *);
+static void cache_extent_next (struct cache_entry *, struct extent_array *);
+static void cache_extent_put (struct cache_entry *, struct extent_array *);
+static bool cache_extent_locate (struct cache_entry *, size_t,
+                                 struct extent_array *, uint32_t *slot,
+                                 size_t *skip);
+static bool cache_extent_continues (const struct extent *, block_sector_t);
+static bool cache_extent_insert (struct extent_array *, uint32_t,
+                                 struct extent, block_sector_t owner);
+static void cache_extent_delete (struct extent_array *, uint32_t);
+static void cache_extent_merge (struct extent_array *, uint32_t);
+static bool cache_extent_split (struct extent_array *, uint32_t, size_t,
+                                block_sector_t, block_sector_t,
+                                block_sector_t owner);
+static bool cache_extent_append (struct cache_entry *, block_sector_t,
+                                 block_sector_t, block_sector_t owner);
+static void cache_extent_extend (struct cache_entry *, off_t,
+                                 block_sector_t owner);
+static void cache_extent_reserve (size_t, size_t, block_sector_t,
+                                  struct extent *);
+static block_sector_t cache_extent_take (size_t, block_sector_t,
+                                         block_sector_t, struct extent *,
+                                         block_sector_t *);
+static bool cache_extent_fill (struct cache_entry *, size_t, size_t,
+                               size_t, size_t, block_sector_t owner,
+                               struct extent *, size_t *next);
+static void cache_extent_free (const struct extent *, block_sector_t);
+static void cache_extent_release (struct inode_disk *);
+static void cache_extent_release_chain (block_sector_t);
+static void cache_extent_truncate (struct cache_entry *, size_t,
+                                   block_sector_t owner);
+static bool cache_inline_convert (struct cache_entry *, block_sector_t owner);
+static void cache_flush (bool (*pick) (struct cache_entry *, void *),
+                         void *aux);
+static bool cache_pick_all (struct cache_entry *, void *);
+static bool cache_pick_expired (struct cache_entry *, void *);
+static bool cache_pick_owner (struct cache_entry *, void *);
+static bool cache_pick_in_log (struct cache_entry *, void *);
 
 /* Returns the number of sectors to allocate for an inode SIZE
    bytes long. */
@@ -38,63 +165,184 @@ bytes_to_sectors (off_t size)
 }
 
 /* Write behind period (ticks) */
-#define WRITE_BEHIND_PERIOD 1000000000000
+#define WRITE_BEHIND_PERIOD TIMER_FREQ
 
-/* Lock state */
-/*
-enum lock_state
+/* Writers start writing back old dirty entries themselves above
+   DIRTY_HIGH dirty entries, until DIRTY_LOW are left */
+#define DIRTY_HIGH (cache_size / 2)
+#define DIRTY_LOW (cache_size / 4)
+
+/* Dirty entries collected by one round of cache_flush (), and the
+   most sectors merged into one write, a page of flush_buf */
+#define FLUSH_BATCH 64
+#define FLUSH_RUN (PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* Staging page that merged write-backs are copied into */
+static uint8_t *flush_buf;
+static struct lock flush_lock;
+/* Signaled, with c_lock, when a merged write-back is on disk */
+static struct condition c_flushed;
+
+/* Read-ahead window bounds (sectors) and maximum queued requests */
+#define READ_AHEAD_MIN 1
+#define READ_AHEAD_MAX 32
+#define READ_AHEAD_QUEUE 64
+
+/* Current read-ahead window, grown while prefetched sectors get used
+   and halved when they are evicted unused. Protected by c_lock. */
+static int ahead_window = 4;
+
+/* Buffer cache replacement policy.
+   Every function is called with c_lock held. */
+struct cache_policy
 {
-  LOCK_FREE,
-  LOCK_READ,
-  LOCK_WRITE,
-};*/
+  const char *name;                             /* -cache-policy name */
+  void (*insert) (struct cache_entry *);        /* CE got a new sector */
+  void (*access) (struct cache_entry *);        /* Cache hit on CE */
+  struct cache_entry *(*victim) (void);         /* Evictable entry to reuse,
+                                                   NULL if none */
+  void (*evict) (struct cache_entry *);         /* CE is going to be reused */
+  void (*discard) (struct cache_entry *);       /* CE's sector was freed */
+};
+
+static const struct cache_policy fifo_policy;
+static const struct cache_policy clock_policy;
+static const struct cache_policy lru_policy;
+static const struct cache_policy twoq_policy;
+
+/* Policies selectable by -cache-policy, and the one in use */
+static const struct cache_policy *const policies[] =
+  {&fifo_policy, &clock_policy, &lru_policy, &twoq_policy, NULL};
+static const struct cache_policy *policy = &clock_policy;
+
+/* 2Q queue sizes: A1in is kept to TWOQ_KIN entries when Am has
+   evictable ones, A1out remembers the last TWOQ_KOUT sectors
+   evicted from A1in */
+#define TWOQ_KIN (cache_size / 4)
+#define TWOQ_KOUT (cache_size / 2)
+static block_sector_t *a1out;
+static int a1out_next;
+
+/* Statistics, protected by c_lock */
+static unsigned long long hit_cnt;      /* Lookups found in the cache */
+static unsigned long long miss_cnt;     /* Lookups read from disk */
+static unsigned long long ahead_cnt;    /* Sectors read ahead */
+static unsigned long long evict_cnt;    /* Sectors dropped for others */
+static unsigned long long write_back_cnt; /* Dirty sectors written */
 
 /* Structure for cache entry */
 struct cache_entry
 {
   struct list_elem elem;        /* List elem pushed in cache */
+  struct hash_elem hash_elem;   /* Hash elem pushed in cache_map */
+  struct list_elem dirty_elem;  /* List elem pushed in dirty_list */
+  struct list_elem policy_elem; /* List elem used by policy or free_list */
+  bool accessed;                /* Reference bit for clock */
+  bool hot;                     /* In 2Q's Am queue */
   block_sector_t sector;        /* Sector number of disk location */
   bool dirty;                   /* Dirty bit */
-  uint8_t *data;                /* Actual data that are cached */
-  int index;                    /* Cache index (0~64, 0: free map)*/
-  int use_cnt;                  /* How many threads use this cache entry */
+  int64_t dirty_time;           /* Ticks when it became dirty */
+  block_sector_t owner;         /* Inode sector that dirtied it */
+  unsigned dirty_gen;           /* Bumped by every cache_mark_dirty () */
+  bool logged;                  /* Changed by the running transaction,
+                                   kept off the disk until it commits */
+  bool in_log;                  /* Committed to the journal, written
+                                   home lazily */
+  bool ahead;                   /* Read ahead and not used yet */
+  bool flushing;                /* Copied into flush_buf, on its way to
+                                   disk, protected by c_lock */
+  uint8_t *data;                /* Actual data, a sector of cache_arena */
+  int index;                    /* Slot index (0: free map) */
+  int use_cnt;                  /* Threads holding or waiting for this
+                                   entry, protected by c_lock */
+  int pin_cnt;                  /* cache_pin () calls not undone yet,
+                                   protected by c_lock */
   
-  //bool valid;                   /* Valid bit */
-  //int read_cnt;                 /* Reader count */
-  //int write_cnt;                /* Writer count */
-  //int pending_cnt;              /* Pending count for read/write requests */
-  //struct lock lock;             /* Read-write lock */
-  //enum lock_state state;        /* State of lock */
-  //struct condition r_end;       /* Signaled when read ends */
-  //struct condition w_end;       /* Signaled when write ends */
-  //bool touchable;               /* Can evict this cache entry */
+  int read_cnt;                 /* Reader count */
+  int write_cnt;                /* Writer count */
+  struct lock lock;             /* Protects read_cnt and write_cnt */
+  struct condition r_end;       /* Signaled when read ends */
+  struct condition w_end;       /* Signaled when write ends */
 };
 
-/*
+/* Read-ahead request */
 struct q_entry
 {
-  struct list_elem elem;        // List elem pushed in queue 
-  block_sector_t sector;        // Sector number of block location 
-};*/
+  struct list_elem elem;        /* List elem pushed in queue */
+  block_sector_t sector;        /* Sector number of block location */
+};
 
 /* Cache initialization */
 void cache_init (void)
 {
+  int i;
+
   list_init (&cache);
+  list_init (&free_list);
+  /* Every slot starts out empty on free_list */
+  cache_slots = malloc (cache_size * sizeof *cache_slots);
+  cache_arena = palloc_get_multiple (0, CACHE_PAGES);
+  a1out = malloc (TWOQ_KOUT * sizeof *a1out);
+  flush_buf = palloc_get_page (0);
+  if (cache_slots == NULL || cache_arena == NULL || a1out == NULL
+      || flush_buf == NULL)
+    PANIC ("buffer cache allocation failed");
+  for (i = 0; i < cache_size; i++)
+  {
+    struct cache_entry *ce = &cache_slots[i];
+
+    lock_init (&ce->lock);
+    cond_init (&ce->w_end);
+    cond_init (&ce->r_end);
+    ce->read_cnt = 0;
+    ce->write_cnt = 0;
+    ce->data = cache_arena + i * BLOCK_SECTOR_SIZE;
+    ce->index = i;
+    ce->sector = CACHE_NO_SECTOR;
+    ce->use_cnt = 0;
+    ce->pin_cnt = 0;
+    ce->dirty = false;
+    ce->logged = false;
+    ce->in_log = false;
+    ce->ahead = false;
+    ce->flushing = false;
+    list_push_back (&cache, &ce->elem);
+    list_push_back (&free_list, &ce->policy_elem);
+  }
+  list_init (&lru_list);
+  list_init (&a1in_list);
+  for (i = 0; i < TWOQ_KOUT; i++)
+  {
+    a1out[i] = CACHE_NO_SECTOR;
+  }
+  list_init (&dirty_list);
+  hash_init (&cache_map, cache_hash, cache_less, NULL);
   lock_init (&c_lock);
+  cond_init (&c_evictable);
+  pinned_cnt = 0;
+  lock_init (&flush_lock);
+  cond_init (&c_flushed);
   
-  //list_init (&queue);
-  //lock_init (&q_lock);
-  //cond_init (&q_not_empty);
+  list_init (&queue);
+  lock_init (&q_lock);
+  cond_init (&q_not_empty);
 }
 
 /* Cache destruction */
 void cache_destroy (void)
 {
-  //printf ("[cache_destroy]\n");
   struct list_elem *e;
   struct cache_entry *ce;
 
+  q_destroy ();
+  cache_flush (cache_pick_all, NULL);
+  lock_acquire (&c_lock);
+  cache_closed = true;
+  lock_release (&c_lock);
+  /* Let a flush in progress finish, later ones see cache_closed */
+  lock_acquire (&flush_lock);
+  lock_release (&flush_lock);
+
   lock_acquire (&c_lock);
   while (!list_empty (&cache))
   {
@@ -104,276 +352,1406 @@ void cache_destroy (void)
     { 
       block_write (fs_device, ce->sector, ce->data);
       ce->dirty = false;
+      write_back_cnt++;
     }
-    free (ce->data);
-    free (ce);
   }
+  palloc_free_multiple (cache_arena, CACHE_PAGES);
+  palloc_free_page (flush_buf);
+  free (cache_slots);
+  free (a1out);
+  cache_arena = NULL;
+  flush_buf = NULL;
+  cache_slots = NULL;
+  a1out = NULL;
+  hash_clear (&cache_map, NULL);
+  list_init (&free_list);
+  list_init (&lru_list);
+  list_init (&a1in_list);
+  list_init (&dirty_list);
+  dirty_cnt = 0;
+  logged_cnt = 0;
+  saved_victim = NULL;
   lock_release (&c_lock);
 }
 
+/* Hash function for cache_map, keyed by sector number */
+static unsigned
+cache_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct cache_entry *ce = hash_entry (e, struct cache_entry, hash_elem);
+  return hash_int (ce->sector);
+}
+
+/* Compare function for cache_map */
+static bool
+cache_less (const struct hash_elem *a_, const struct hash_elem *b_,
+            void *aux UNUSED)
+{
+  const struct cache_entry *a = hash_entry (a_, struct cache_entry, hash_elem);
+  const struct cache_entry *b = hash_entry (b_, struct cache_entry, hash_elem);
+
+  return a->sector < b->sector;
+}
+
 /* Find cache entry pointer with block sector number and return NULL if none*/
 static struct cache_entry *
 cache_find (block_sector_t sector)
 {
-  //printf ("[cache find] sector: %d\n", sector);
-  struct list_elem *e;
+  struct cache_entry key;
+  struct hash_elem *e;
+
+  key.sector = sector;
+  e = hash_find (&cache_map, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct cache_entry, hash_elem) : NULL;
+}
+
+/* Try to get data from SECTOR in cache or block read if there is none.
+ * The entry is returned locked, shared or EXCLUSIVE, and must be given
+ * back with cache_release_block().
+ * c_lock is only held for the lookup and allocation, the disk read of
+ * a missing sector is done with the entry locked exclusively instead,
+ * so a miss doesn't block hits on other sectors. */
+static struct cache_entry *
+cache_get_block (block_sector_t sector, bool exclusive)
+{
+  return cache_get (sector, exclusive, true);
+}
+
+/* Get the cache entry for SECTOR locked exclusively, like
+ * cache_get_block(), but on a miss don't read SECTOR from disk.
+ * The caller must overwrite all of the entry's data before
+ * releasing it. */
+static struct cache_entry *
+cache_get_new_block (block_sector_t sector)
+{
+  return cache_get (sector, true, false);
+}
 
-  for (e = list_begin (&cache); e != list_end (&cache); e = list_next (e))
+/* Common part of cache_get_block() and cache_get_new_block(),
+ * FILL tells whether a missing sector is read from disk */
+static struct cache_entry *
+cache_get (block_sector_t sector, bool exclusive, bool fill)
+{
+  struct cache_entry *ce;
+  bool miss;
+
+  for (;;)
   {
-    struct cache_entry *ce = list_entry (e, struct cache_entry, elem);
+    miss = false;
+    lock_acquire (&c_lock);
+    ce = cache_find (sector);
+
+    /* There is no corresponding block for the sector
+     * and create new cache_entry */
+    while (ce == NULL)
+    {
+      ce = cache_alloc (sector, true);
+      if (ce != NULL)
+      {
+        miss = true;
+      }
+      else
+      {
+        /* c_lock was dropped in cache_alloc, somebody else may
+           have brought SECTOR in meanwhile */
+        ce = cache_find (sector);
+      }
+    }
+    ce->use_cnt++;
+    /* Nobody else can hold a new entry yet, so this doesn't wait */
+    if (miss)
+    {
+      miss_cnt++;
+      cache_lock (ce, true);
+    }
+    else
+    {
+      hit_cnt++;
+      policy->access (ce);
+      if (ce->ahead)
+      {
+        cache_ahead_used (ce);
+      }
+    }
+    lock_release (&c_lock);
+    if (miss)
+    {
+      break;
+    }
+
+    cache_lock (ce, exclusive);
+    /* The holder we waited for may have discarded CE, then look
+       SECTOR up again */
     if (ce->sector == sector)
     {
       return ce;
     }
+    cache_release_block (ce, exclusive);
+  }
+
+  /* Block read in cache data */
+  if (fill)
+  {
+    block_read (fs_device, sector, ce->data);
+  }
+  if (!exclusive)
+  {
+    /* Downgrade to shared and let waiting readers in */
+    lock_acquire (&ce->lock);
+    ce->write_cnt--;
+    ce->read_cnt++;
+    cond_broadcast (&ce->w_end, &ce->lock);
+    lock_release (&ce->lock);
   }
- return NULL;
+  return ce;
 }
 
-/* Try to get data from SECTOR in cache or block read if there is none */
-static struct cache_entry *cache_get_block (block_sector_t sector)
+/* Unlock CE that was got by cache_get_block() */
+static void
+cache_release_block (struct cache_entry *ce, bool exclusive)
 {
-  //printf ("[cache get block] thread%d, sector: %d\n", thread_current ()->tid, sector);
+  cache_unlock (ce, exclusive);
   lock_acquire (&c_lock);
-  struct cache_entry *ce = cache_find (sector);
-  
-  /* There is no corresponding block for the sector
-   * and create new cache_entry */
-  if (ce == NULL)
+  cache_unuse (ce);
+  lock_release (&c_lock);
+}
+
+/* Drop one use of CE, c_lock must be held. Wakes up a thread
+ * waiting for a victim if CE can be evicted now. */
+static void
+cache_unuse (struct cache_entry *ce)
+{
+  ASSERT (ce->use_cnt > 0);
+  if (--ce->use_cnt == 0 && ce->pin_cnt == 0)
   {
-    //printf ("cache miss! sector %d\n", sector);
-    //printf ("cache entry is NULL for sector : %d\n", sector);
-    ce = cache_alloc (sector);
+    cond_signal (&c_evictable, &c_lock);
   }
-  ce->use_cnt++;
-  //ce->read_cnt++;
-  lock_release (&c_lock);
-  return ce;
 }
 
-/* Allocate one cache entry */
+/* Lock CE shared among readers, or EXCLUSIVE for a writer */
+static void
+cache_lock (struct cache_entry *ce, bool exclusive)
+{
+  lock_acquire (&ce->lock);
+  if (exclusive)
+  {
+    while (ce->read_cnt > 0 || ce->write_cnt > 0)
+    {
+      if (ce->write_cnt > 0)
+      {
+        cond_wait (&ce->w_end, &ce->lock);
+      }
+      else
+      {
+        cond_wait (&ce->r_end, &ce->lock);
+      }
+    }
+    ce->write_cnt++;
+  }
+  else
+  {
+    while (ce->write_cnt > 0)
+    {
+      cond_wait (&ce->w_end, &ce->lock);
+    }
+    ce->read_cnt++;
+  }
+  lock_release (&ce->lock);
+}
+
+/* Lock CE shared like cache_lock () if no writer has it, returns
+ * false instead of waiting */
+static bool
+cache_try_lock (struct cache_entry *ce)
+{
+  bool success;
+
+  lock_acquire (&ce->lock);
+  success = ce->write_cnt == 0;
+  if (success)
+  {
+    ce->read_cnt++;
+  }
+  lock_release (&ce->lock);
+  return success;
+}
+
+/* Unlock CE locked by cache_lock() */
+static void
+cache_unlock (struct cache_entry *ce, bool exclusive)
+{
+  lock_acquire (&ce->lock);
+  if (exclusive)
+  {
+    ce->write_cnt--;
+    cond_broadcast (&ce->w_end, &ce->lock);
+  }
+  else if (--ce->read_cnt == 0)
+  {
+    cond_broadcast (&ce->r_end, &ce->lock);
+  }
+  lock_release (&ce->lock);
+}
+
+/* Allocate one cache entry for SECTOR, c_lock must be held.
+ * Returns NULL if c_lock had to be released on the way, in which
+ * case the caller should look SECTOR up again. If every entry is
+ * in use, waits for one to become evictable if WAIT, otherwise
+ * returns NULL right away. */
 static struct cache_entry *
-cache_alloc (block_sector_t sector)
+cache_alloc (block_sector_t sector, bool wait)
 {
-  //printf ("[cache alloc] sector: %d\n", sector);
   struct cache_entry *ce;
   
-  /* If list size is 64, eviction is needed */
-  if (list_size (&cache) == 65)
+  ASSERT (lock_held_by_current_thread (&c_lock));
+
+  /* Evict one cache entry and reuse its slot in place */
+  ce = cache_evict ();
+  if (ce == NULL)
+  {
+    /* Every entry is in use or pinned, wait for one */
+    if (wait)
+    {
+      cond_wait (&c_evictable, &c_lock);
+    }
+    return NULL;
+  }
+  /* Write back outside c_lock, the entry stays findable under its
+     old sector and pinned until the write is done */
+  if (ce->dirty)
   {
-    /* Evict one cache entry and use that entry again */
-    ce = cache_evict ();
-    free (ce->data);
-    ce->data = (uint8_t *) malloc (BLOCK_SECTOR_SIZE);
-    memset (ce->data, 0x00, BLOCK_SECTOR_SIZE);
+    cache_write_back (ce);
+    return NULL;
   }
-  /* Allocate new cache entry */
-  else
+  /* Entries taken from free_list don't cache anything */
+  if (ce->sector != CACHE_NO_SECTOR)
   {
-    ce = (struct cache_entry *) malloc (sizeof (struct cache_entry));
-    //lock_init (&ce->lock);
-    //cond_init (&ce->w_end);
-    //cond_init (&ce->r_end);
-    ce->data = (uint8_t *) malloc (BLOCK_SECTOR_SIZE);
-    ce->index = list_size (&cache);
-    
-    list_push_back (&cache, &ce->elem);
+    hash_delete (&cache_map, &ce->hash_elem);
+    if (ce->ahead)
+    {
+      cache_ahead_wasted (ce);
+    }
+    policy->evict (ce);
+    evict_cnt++;
   }
   /* Cache entry initialization */
   ce->sector = sector;
+  hash_insert (&cache_map, &ce->hash_elem);
+  policy->insert (ce);
   ce->use_cnt = 0;
+  ce->pin_cnt = 0;
   ce->dirty = false;
-  //ce->valid = true;
-  //ce->read_cnt = 0;
-  //ce->write_cnt = 0;
-  //ce->pending_cnt = 0;
-  //ce->state = LOCK_FREE;
-
-  /* Block read in cache data */
-  block_read (fs_device, ce->sector, ce->data);
+  ce->logged = false;
+  ce->in_log = false;
+  ce->ahead = false;
   
   return ce;
 }
 
-/* Evict one cache entry */
+/* Evict one cache entry, c_lock must be held.
+ * Empty and discarded slots are reused first, then the policy chooses.
+ * Returns NULL if every entry is in use. */
 static struct cache_entry *
 cache_evict (void)
 {
-  //printf ("[cache evict]\n");
-  /* FIFO algorithm is used */
   struct list_elem *e;
-  struct cache_entry *victim;
-  
-  /* Find the victim */
-  if (saved_victim == NULL)
+
+  for (e = list_begin (&free_list); e != list_end (&free_list);
+       e = list_next (e))
   {
-    e = list_begin (&cache);
+    struct cache_entry *ce = list_entry (e, struct cache_entry, policy_elem);
+    if (ce->use_cnt == 0)
+    {
+      list_remove (e);
+      return ce;
+    }
   }
-  else 
+  return policy->victim ();
+}
+
+/* Can policies choose CE as a victim? */
+static bool
+cache_evictable (struct cache_entry *ce)
+{
+  /* If use cnt is not 0, we must not evict that cache entry 
+     because it is used in some threads. Pinned entries stay until
+     cache_unpin (), logged ones until their transaction commits.
+     Discarded entries are handed out from free_list instead.
+   */
+  return ce->use_cnt == 0 && ce->pin_cnt == 0 && !ce->logged
+         && ce->sector != CACHE_NO_SECTOR;
+}
+
+/* Forget the contents of CE without writing them back, used for
+ * sectors that were just freed. CE must be locked exclusively by
+ * the caller. It is reused before any other entry. A copy being
+ * written back is let land first, so that it can't overwrite
+ * whatever the sector holds once it is allocated again. */
+static void
+cache_discard (struct cache_entry *ce)
+{
+  lock_acquire (&c_lock);
+  while (ce->flushing)
   {
-    e = saved_victim;
+    cond_wait (&c_flushed, &c_lock);
   }
-  victim = list_entry (e, struct cache_entry, elem);
-  
-  /* Don't evict index with 0 because it is allocated for free map.
-     If use cnt is not 0, we must not evict that cache entry 
-     because it is used in some threads.
-   */
-  while (victim->sector == 0 || victim->use_cnt != 0)
+  hash_delete (&cache_map, &ce->hash_elem);
+  cache_clean (ce);
+  if (ce->logged)
+  {
+    ce->logged = false;
+    logged_cnt--;
+  }
+  if (ce->pin_cnt > 0)
+  {
+    ce->pin_cnt = 0;
+    pinned_cnt--;
+  }
+  policy->discard (ce);
+  ce->sector = CACHE_NO_SECTOR;
+  ce->ahead = false;
+  list_push_back (&free_list, &ce->policy_elem);
+  lock_release (&c_lock);
+}
+
+/* Selects the replacement policy called NAME.
+ * Must be called before cache_init (). Returns false if there is
+ * no such policy. */
+bool
+cache_set_policy (const char *name)
+{
+  const struct cache_policy *const *p;
+
+  for (p = policies; *p != NULL; p++)
   {
-    e = list_next (e);
-    if (e == list_end (&cache))
+    if (!strcmp ((*p)->name, name))
     {
-      e = list_begin (&cache);
+      policy = *p;
+      return true;
     }
-    victim = list_entry (e, struct cache_entry, elem);
   }
-  
-  /* Should we wrtie on disk? (= Dirty?) */
-  if (victim->dirty)
+  return false;
+}
+
+/* Keep SECTOR in the cache until a matching cache_unpin (), so
+ * that it is never evicted. Pins nest. Returns false, without
+ * pinning, if PIN_MAX entries are pinned already. */
+bool
+cache_pin (block_sector_t sector)
+{
+  struct cache_entry *ce = cache_get_block (sector, false);
+  bool success = true;
+
+  lock_acquire (&c_lock);
+  if (ce->pin_cnt == 0)
   {
-    /* Block write */
-    block_write (fs_device, victim->sector, victim->data);
-    victim->dirty = false;
+    if (pinned_cnt < PIN_MAX)
+    {
+      pinned_cnt++;
+    }
+    else
+    {
+      success = false;
+    }
   }
-  
-  /* Update saved_victim */
-  e = list_next (e);
-  if (e == list_end (&cache))
+  if (success)
   {
-    e = list_begin (&cache);
+    ce->pin_cnt++;
   }
-  saved_victim = e;
-   
-  return victim;
+  lock_release (&c_lock);
+  cache_release_block (ce, false);
+  return success;
 }
 
-/* Read aheader function
- * This function will used in kernel thread read_aheader */
-/*
-void read_aheader_func (void)
+/* Undo one cache_pin () of SECTOR */
+void
+cache_unpin (block_sector_t sector)
 {
-  while (true)
+  struct cache_entry *ce;
+
+  lock_acquire (&c_lock);
+  ce = cache_find (sector);
+  if (ce != NULL && ce->pin_cnt > 0 && --ce->pin_cnt == 0)
   {
-    lock_acquire (&q_lock);
-    while (list_empty (&queue))
-    { 
-      cond_wait (&q_not_empty, &q_lock);
+    pinned_cnt--;
+    if (ce->use_cnt == 0)
+    {
+      cond_signal (&c_evictable, &c_lock);
     }
-    //printf ("read ahead function !!!!!!!!!!!!!!!!!!\n");
-    struct list_elem *e = list_pop_front (&queue);
-    struct q_entry *qe = list_entry (e, struct q_entry, elem);
-    
-    struct cache_entry *ce = cache_get_block (qe->sector);
-    ce->use_cnt--; 
-    lock_release (&q_lock);
   }
-}*/
+  lock_release (&c_lock);
+}
 
-/* Cache read ahead 
- * Push read ahead request in queue */
-/*
-static void cache_read_ahead (block_sector_t sector)
+/* Sets the number of cache entries to N.
+ * Must be called before cache_init (). Returns false if N is out
+ * of range. */
+bool
+cache_set_size (int n)
 {
-  lock_acquire (&q_lock);
-  struct q_entry *qe = (struct q_entry *) malloc (sizeof (struct q_entry));
-  qe->sector = sector;
-  list_push_back (&queue, &qe->elem);
-  cond_signal (&q_not_empty, &q_lock);
-  lock_release (&q_lock);
-}*/
+  if (n < CACHE_MIN || n > CACHE_MAX)
+  {
+    return false;
+  }
+  cache_size = n;
+  return true;
+}
 
-/* Flusher function 
- * This function will used in kernel thread flusher */
-/*
-void flusher_func (void)
+/* Sets the age in TICKS past which the flusher writes back dirty
+ * entries. Returns false if TICKS is out of range. */
+bool
+cache_set_flush_age (int ticks)
 {
-  while (true)
+  if (ticks < FLUSH_AGE_MIN || ticks > FLUSH_AGE_MAX)
   {
-    timer_sleep (WRITE_BEHIND_PERIOD);
-    cache_write_behind ();
+    return false;
   }
-}*/
+  cache_flush_age = ticks;
+  return true;
+}
 
-/* Cache write behind
- * Flush all dirty cache slots */
-void cache_write_behind (void)
+/* Prints buffer cache statistics */
+void
+cache_print_stats (void)
+{
+  printf ("Buffer cache (%d entries, %s): %llu hits, %llu misses, "
+          "%llu read-aheads, %llu evictions, %llu write-backs\n",
+          cache_size, policy->name, hit_cnt, miss_cnt, ahead_cnt,
+          evict_cnt, write_back_cnt);
+}
+
+/* Next element of cache after E, wrapping around */
+static struct list_elem *
+cache_next (struct list_elem *e)
+{
+  e = list_next (e);
+  return e != list_end (&cache) ? e : list_begin (&cache);
+}
+
+/* First evictable entry on policy list L, or NULL */
+static struct cache_entry *
+policy_first (struct list *l)
 {
   struct list_elem *e;
-  
-  if (list_empty (&cache))
-  {
-    return;
-  }
 
-  for (e = list_front (&cache); e != list_end (&cache);
-       e = list_next (e))
+  for (e = list_begin (l); e != list_end (l); e = list_next (e))
   {
-    struct cache_entry *ce = list_entry (e, struct cache_entry, elem);
-    if (ce->dirty) 
+    struct cache_entry *ce = list_entry (e, struct cache_entry, policy_elem);
+    if (cache_evictable (ce))
     {
-      block_write (fs_device, ce->sector, ce->data);
-      ce->dirty = false;
+      return ce;
     }
   }
+  return NULL;
 }
 
-/* Queue destruction */
-/*
-void q_destroy (void)
+/* Nothing to do for this policy */
+static void
+policy_nop (struct cache_entry *ce UNUSED)
 {
-  struct list_elem *e;
-  struct q_entry *qe;
-  while (!list_empty (&queue))
-  {
-    e = list_pop_front (&queue);
-    qe = list_entry (e, struct q_entry, elem);
-    free (qe);
-  }
-}*/
+}
 
-/* Cache read at from sector plus offset to dst by size */
-off_t
-cache_read_at (void *dst, block_sector_t sector, off_t size, off_t offset,
-    block_sector_t next_sector UNUSED, bool ahead UNUSED)
+/* Policy unlinks CE from its list */
+static void
+policy_unlink (struct cache_entry *ce)
 {
-  struct cache_entry *ce = cache_get_block (sector);
+  list_remove (&ce->policy_elem);
+}
 
-  memcpy (dst, ce->data + offset, size); 
-  ce->use_cnt--;
+/* FIFO: entries are reused in the order they got their sector */
+static struct cache_entry *
+fifo_victim (void)
+{
+  struct list_elem *e = saved_victim != NULL ? saved_victim : list_begin (&cache);
+  size_t i, n = list_size (&cache);
 
-  return size;
+  for (i = 0; i < n; i++, e = cache_next (e))
+  {
+    struct cache_entry *ce = list_entry (e, struct cache_entry, elem);
+    if (cache_evictable (ce))
+    {
+      return ce;
+    }
+  }
+  return NULL;
 }
 
-/* Cache write from src to sector plus offset by size*/
-off_t
-cache_write_at (block_sector_t sector, void *src, off_t size, off_t offset)
+static void
+fifo_evict (struct cache_entry *ce)
 {
-  struct cache_entry *ce = cache_get_block (sector);
+  saved_victim = cache_next (&ce->elem);
+}
 
-  memcpy (ce->data + offset, src, size);
-  ce->dirty = true;
-  ce->use_cnt--;
-  
-  return size;
+static const struct cache_policy fifo_policy =
+  {"fifo", policy_nop, policy_nop, fifo_victim, fifo_evict, policy_nop};
+
+/* Clock: FIFO that gives entries referenced since the hand last
+   passed a second chance */
+static void
+clock_access (struct cache_entry *ce)
+{
+  ce->accessed = true;
 }
 
-/* Close the Inode in given sector,
- * so need to release corresponding sectors in free map */
-void cache_close_inode (block_sector_t sector)
+static struct cache_entry *
+clock_victim (void)
 {
-  //printf ("[cache close inode]\n");
-  struct cache_entry *inode_ce = cache_get_block (sector);
-  struct inode_disk *inode_id = (struct inode_disk *) inode_ce->data;
-  off_t sector_remained = DIV_ROUND_UP (inode_id->length, BLOCK_SECTOR_SIZE);
-  
-  /* Release inode_disk */
-  if (inode_ce->dirty)
+  struct list_elem *e = saved_victim != NULL ? saved_victim : list_begin (&cache);
+  size_t i, n = 2 * list_size (&cache);
+
+  /* Two turns clear every reference bit on the way */
+  for (i = 0; i < n; i++, e = cache_next (e))
   {
-    /* Should not enter here, because we already write behind before this function call */
-    block_write (fs_device, sector, inode_id);
-  }
-  
-  /* Release direct blocks */
+    struct cache_entry *ce = list_entry (e, struct cache_entry, elem);
+    if (!cache_evictable (ce))
+    {
+      continue;
+    }
+    if (ce->accessed)
+    {
+      ce->accessed = false;
+      continue;
+    }
+    saved_victim = e;
+    return ce;
+  }
+  return NULL;
+}
+
+static const struct cache_policy clock_policy =
+  {"clock", clock_access, clock_access, clock_victim, fifo_evict, policy_nop};
+
+/* LRU: the least recently used entry is reused */
+static void
+lru_insert (struct cache_entry *ce)
+{
+  list_push_back (&lru_list, &ce->policy_elem);
+}
+
+static void
+lru_access (struct cache_entry *ce)
+{
+  list_remove (&ce->policy_elem);
+  list_push_back (&lru_list, &ce->policy_elem);
+}
+
+static struct cache_entry *
+lru_victim (void)
+{
+  return policy_first (&lru_list);
+}
+
+static const struct cache_policy lru_policy =
+  {"lru", lru_insert, lru_access, lru_victim, policy_unlink, policy_unlink};
+
+/* 2Q: sectors seen once wait in the A1in FIFO and only move to the
+   Am LRU queue if they are referenced again soon after being evicted
+   (their sector is still in A1out). A large scan thus only cycles
+   through A1in and leaves the hot entries in Am alone. */
+static bool
+a1out_take (block_sector_t sector)
+{
+  int i;
+
+  for (i = 0; i < TWOQ_KOUT; i++)
+  {
+    if (a1out[i] == sector)
+    {
+      a1out[i] = CACHE_NO_SECTOR;
+      return true;
+    }
+  }
+  return false;
+}
+
+static void
+twoq_insert (struct cache_entry *ce)
+{
+  ce->hot = a1out_take (ce->sector);
+  if (ce->hot)
+  {
+    list_push_back (&lru_list, &ce->policy_elem);
+  }
+  else
+  {
+    list_push_back (&a1in_list, &ce->policy_elem);
+  }
+}
+
+static void
+twoq_access (struct cache_entry *ce)
+{
+  if (ce->hot)
+  {
+    lru_access (ce);
+  }
+}
+
+static struct cache_entry *
+twoq_victim (void)
+{
+  struct cache_entry *ce = NULL;
+
+  if (list_size (&a1in_list) > (size_t) TWOQ_KIN)
+  {
+    ce = policy_first (&a1in_list);
+  }
+  if (ce == NULL)
+  {
+    ce = policy_first (&lru_list);
+  }
+  if (ce == NULL)
+  {
+    ce = policy_first (&a1in_list);
+  }
+  return ce;
+}
+
+static void
+twoq_evict (struct cache_entry *ce)
+{
+  list_remove (&ce->policy_elem);
+  if (!ce->hot)
+  {
+    a1out[a1out_next] = ce->sector;
+    a1out_next = (a1out_next + 1) % TWOQ_KOUT;
+  }
+}
+
+static const struct cache_policy twoq_policy =
+  {"2q", twoq_insert, twoq_access, twoq_victim, twoq_evict, policy_unlink};
+
+/* Mark CE, which must be locked exclusively, dirty on behalf of the
+ * inode in sector OWNER. Within a journal handle the change is
+ * logged too. */
+static void
+cache_mark_dirty (struct cache_entry *ce, block_sector_t owner)
+{
+  cache_set_dirty (ce, owner);
+  if (!ce->logged && journal_active ())
+  {
+    cache_log (ce);
+  }
+}
+
+/* Add CE, locked exclusively, to the running journal transaction.
+ * It stays in the cache until the transaction commits. */
+static void
+cache_log (struct cache_entry *ce)
+{
+  lock_acquire (&c_lock);
+  journal_add (ce->sector);
+  ce->logged = true;
+  logged_cnt++;
+  ASSERT (logged_cnt <= LOG_MAX);
+  lock_release (&c_lock);
+}
+
+/* Mark CE dirty like cache_mark_dirty (), but never log the change,
+ * for file data */
+static void
+cache_set_dirty (struct cache_entry *ce, block_sector_t owner)
+{
+  ce->owner = owner;
+  ce->dirty_gen++;
+  if (ce->dirty)
+  {
+    return;
+  }
+  lock_acquire (&c_lock);
+  ce->dirty = true;
+  ce->dirty_time = timer_ticks ();
+  list_push_back (&dirty_list, &ce->dirty_elem);
+  dirty_cnt++;
+  lock_release (&c_lock);
+}
+
+/* Mark CE clean, c_lock must be held */
+static void
+cache_clean (struct cache_entry *ce)
+{
+  if (ce->dirty)
+  {
+    ce->dirty = false;
+    ce->in_log = false;
+    list_remove (&ce->dirty_elem);
+    dirty_cnt--;
+  }
+}
+
+/* Write CE back to disk if it is dirty and not logged. c_lock must
+ * be held and is released during the write, CE stays pinned and
+ * locked shared meanwhile so it can be neither evicted nor
+ * modified. */
+static void
+cache_write_back (struct cache_entry *ce)
+{
+  bool written = false;
+
+  ce->use_cnt++;
+  lock_release (&c_lock);
+  cache_lock (ce, false);
+  if (ce->dirty && !ce->logged)
+  {
+    block_write (fs_device, ce->sector, ce->data);
+    written = true;
+  }
+  lock_acquire (&c_lock);
+  if (written)
+  {
+    write_back_cnt++;
+    cache_clean (ce);
+  }
+  cache_unlock (ce, false);
+  cache_unuse (ce);
+}
+
+/* Orders cache entries by sector, for sort () */
+static int
+cache_sector_compare (const void *a_, const void *b_, void *aux UNUSED)
+{
+  const struct cache_entry *a = *(struct cache_entry *const *) a_;
+  const struct cache_entry *b = *(struct cache_entry *const *) b_;
+
+  return a->sector < b->sector ? -1 : a->sector > b->sector;
+}
+
+/* Write back the first entries of BATCH, CNT entries sorted by
+ * sector, that cache consecutive sectors as one transfer.
+ * flush_lock must be held. The entries are marked flushing from
+ * when they are copied until the write is done, which keeps them
+ * from being discarded. Unpins the entries it took care of and
+ * returns how many that is, at least one. */
+static size_t
+cache_flush_run (struct cache_entry **batch, size_t cnt)
+{
+  block_sector_t first = batch[0]->sector;
+  unsigned gen[FLUSH_RUN];
+  size_t k, i;
+
+  /* Copy the data out under each entry's lock in turn, never holding
+     two, so this can't deadlock with threads that nest entry locks.
+     Once one is marked flushing, a thread holding a later entry may
+     be waiting in cache_discard () for it, so the run ends at the
+     first entry that can't be locked right away. */
+  for (k = 0; k < cnt && k < FLUSH_RUN; k++)
+  {
+    struct cache_entry *ce = batch[k];
+
+    if (k == 0)
+    {
+      cache_lock (ce, false);
+    }
+    else if (!cache_try_lock (ce))
+    {
+      break;
+    }
+    /* A pinned entry keeps its sector unless it got discarded, and
+       may have been logged since it was picked */
+    if (ce->sector == CACHE_NO_SECTOR || ce->sector != first + k
+        || ce->logged)
+    {
+      cache_unlock (ce, false);
+      break;
+    }
+    memcpy (flush_buf + k * BLOCK_SECTOR_SIZE, ce->data, BLOCK_SECTOR_SIZE);
+    gen[k] = ce->dirty_gen;
+    /* Hold off cache_discard () until the copy is on disk */
+    lock_acquire (&c_lock);
+    ce->flushing = true;
+    lock_release (&c_lock);
+    cache_unlock (ce, false);
+  }
+  if (k > 0)
+  {
+    block_write_multiple (fs_device, first, flush_buf, k);
+  }
+
+  lock_acquire (&c_lock);
+  /* Entries written to since they were copied stay dirty */
+  for (i = 0; i < k; i++)
+  {
+    batch[i]->flushing = false;
+    if (batch[i]->dirty_gen == gen[i])
+    {
+      cache_clean (batch[i]);
+    }
+  }
+  if (k > 0)
+  {
+    cond_broadcast (&c_flushed, &c_lock);
+  }
+  write_back_cnt += k;
+  /* The first entry was discarded meanwhile, just drop it */
+  if (k == 0)
+  {
+    k = 1;
+  }
+  for (i = 0; i < k; i++)
+  {
+    cache_unuse (batch[i]);
+  }
+  lock_release (&c_lock);
+  return k;
+}
+
+/* Write back the dirty entries PICK chooses, in batches sorted by
+ * sector with runs of consecutive sectors merged into one write.
+ * Entries dirtied after the call started may be left dirty, logged
+ * ones always are. */
+static void
+cache_flush (bool (*pick) (struct cache_entry *, void *), void *aux)
+{
+  struct cache_entry *batch[FLUSH_BATCH];
+  struct list_elem *e;
+  int left;
+  size_t n, i;
+
+  lock_acquire (&c_lock);
+  /* Bounded so that writers dirtying entries again can't keep us here */
+  left = dirty_cnt;
+  lock_release (&c_lock);
+
+  while (left > 0)
+  {
+    n = 0;
+    lock_acquire (&c_lock);
+    for (e = list_begin (&dirty_list);
+         !cache_closed && e != list_end (&dirty_list) && n < FLUSH_BATCH;
+         e = list_next (e))
+    {
+      struct cache_entry *ce = list_entry (e, struct cache_entry, dirty_elem);
+      if (!ce->logged && pick (ce, aux))
+      {
+        ce->use_cnt++;
+        batch[n++] = ce;
+      }
+    }
+    lock_release (&c_lock);
+    if (n == 0)
+    {
+      break;
+    }
+
+    sort (batch, n, sizeof *batch, cache_sector_compare, NULL);
+    lock_acquire (&flush_lock);
+    if (cache_closed)
+    {
+      lock_release (&flush_lock);
+      break;
+    }
+    for (i = 0; i < n; )
+    {
+      i += cache_flush_run (batch + i, n - i);
+    }
+    lock_release (&flush_lock);
+    left -= n;
+    if (n < FLUSH_BATCH)
+    {
+      break;
+    }
+  }
+}
+
+/* cache_flush () picks: every dirty entry, entries dirty for
+ * cache_flush_age ticks, entries of the inode in *AUX that aren't
+ * safe in the journal already, entries committed to the journal */
+static bool
+cache_pick_all (struct cache_entry *ce UNUSED, void *aux UNUSED)
+{
+  return true;
+}
+
+static bool
+cache_pick_expired (struct cache_entry *ce, void *aux UNUSED)
+{
+  return timer_elapsed (ce->dirty_time) >= cache_flush_age;
+}
+
+static bool
+cache_pick_owner (struct cache_entry *ce, void *aux)
+{
+  return ce->owner == *(block_sector_t *) aux && !ce->in_log;
+}
+
+static bool
+cache_pick_in_log (struct cache_entry *ce, void *aux UNUSED)
+{
+  return ce->in_log;
+}
+
+/* Too many dirty entries, write back the oldest ones that nobody
+ * uses until DIRTY_LOW are left. Entries in use are skipped so this
+ * never waits on an entry the caller may be holding, and logged
+ * ones because they can't be written yet. */
+static void
+cache_throttle (void)
+{
+  struct list_elem *e;
+
+  lock_acquire (&c_lock);
+  e = list_begin (&dirty_list);
+  while (dirty_cnt > DIRTY_LOW && e != list_end (&dirty_list))
+  {
+    struct cache_entry *ce = list_entry (e, struct cache_entry, dirty_elem);
+    if (ce->use_cnt != 0 || ce->logged)
+    {
+      e = list_next (e);
+      continue;
+    }
+    cache_write_back (ce);
+    /* E left the list, or was dirtied again and moved to its end */
+    e = list_begin (&dirty_list);
+  }
+  lock_release (&c_lock);
+}
+
+/* Read aheader function
+ * This function will used in kernel thread read_aheader */
+void read_aheader_func (void *aux UNUSED)
+{
+  while (true)
+  {
+    lock_acquire (&q_lock);
+    while (list_empty (&queue))
+    { 
+      cond_wait (&q_not_empty, &q_lock);
+    }
+    struct list_elem *e = list_pop_front (&queue);
+    struct q_entry *qe = list_entry (e, struct q_entry, elem);
+    lock_release (&q_lock);
+    
+    cache_prefetch (qe->sector);
+    free (qe);
+  }
+}
+
+/* Cache read ahead 
+ * Push read ahead request in queue.
+ * Requests are dropped while the queue is full. */
+void cache_read_ahead (block_sector_t sector)
+{
+  lock_acquire (&q_lock);
+  if (!q_closed && list_size (&queue) < READ_AHEAD_QUEUE)
+  {
+    struct q_entry *qe = (struct q_entry *) malloc (sizeof (struct q_entry));
+    if (qe != NULL)
+    {
+      qe->sector = sector;
+      list_push_back (&queue, &qe->elem);
+      cond_signal (&q_not_empty, &q_lock);
+    }
+  }
+  lock_release (&q_lock);
+}
+
+/* Returns the number of sectors to read ahead of a sequential reader */
+int cache_read_ahead_window (void)
+{
+  return ahead_window;
+}
+
+/* Bring SECTOR into the cache unless it is there already */
+static void
+cache_prefetch (block_sector_t sector)
+{
+  struct cache_entry *ce;
+
+  lock_acquire (&c_lock);
+  if (cache_find (sector) != NULL)
+  {
+    lock_release (&c_lock);
+    return;
+  }
+  /* Prefetching is only a hint, don't wait for a victim */
+  ce = cache_alloc (sector, false);
+  if (ce == NULL)
+  {
+    lock_release (&c_lock);
+    return;
+  }
+  ce->use_cnt++;
+  ce->ahead = true;
+  ahead_cnt++;
+  cache_lock (ce, true);
+  lock_release (&c_lock);
+
+  block_read (fs_device, sector, ce->data);
+  cache_release_block (ce, true);
+}
+
+/* Prefetched CE got its first real access, c_lock must be held */
+static void
+cache_ahead_used (struct cache_entry *ce)
+{
+  ce->ahead = false;
+  if (ahead_window < READ_AHEAD_MAX)
+  {
+    ahead_window++;
+  }
+}
+
+/* Prefetched CE is dropped without being used, c_lock must be held */
+static void
+cache_ahead_wasted (struct cache_entry *ce)
+{
+  ce->ahead = false;
+  ahead_window /= 2;
+  if (ahead_window < READ_AHEAD_MIN)
+  {
+    ahead_window = READ_AHEAD_MIN;
+  }
+}
+
+/* Flusher function 
+ * This function will used in kernel thread flusher.
+ * Every WRITE_BEHIND_PERIOD it commits the journal and writes back
+ * entries that have been dirty for cache_flush_age ticks or more,
+ * which checkpoints committed ones lazily. */
+void flusher_func (void *aux UNUSED)
+{
+  while (true)
+  {
+    timer_sleep (WRITE_BEHIND_PERIOD);
+    journal_commit ();
+    cache_flush (cache_pick_expired, NULL);
+  }
+}
+
+/* Cache write behind
+ * Flush all dirty cache slots */
+void cache_write_behind (void)
+{
+  cache_flush (cache_pick_all, NULL);
+}
+
+/* Write back the dirty entries that belong to the inode in OWNER,
+ * except those the journal takes care of */
+void cache_flush_inode (block_sector_t owner)
+{
+  cache_flush (cache_pick_owner, &owner);
+}
+
+/* Most entries a journal transaction may change */
+int cache_log_max (void)
+{
+  return LOG_MAX;
+}
+
+/* Copy the contents of SECTOR, changed by the transaction being
+ * committed, to DST. Returns false if it isn't logged anymore,
+ * because it was freed. */
+bool cache_log_copy (block_sector_t sector, void *dst)
+{
+  struct cache_entry *ce;
+  bool logged;
+
+  lock_acquire (&c_lock);
+  ce = cache_find (sector);
+  if (ce == NULL || !ce->logged)
+  {
+    lock_release (&c_lock);
+    return false;
+  }
+  ce->use_cnt++;
+  lock_release (&c_lock);
+
+  cache_lock (ce, false);
+  logged = ce->sector == sector && ce->logged;
+  if (logged)
+  {
+    memcpy (dst, ce->data, BLOCK_SECTOR_SIZE);
+  }
+  cache_release_block (ce, false);
+  return logged;
+}
+
+/* SECTOR's transaction is committed, it may be written home now */
+void cache_log_done (block_sector_t sector)
+{
+  struct cache_entry *ce;
+
+  lock_acquire (&c_lock);
+  ce = cache_find (sector);
+  if (ce != NULL && ce->logged)
+  {
+    ce->logged = false;
+    ce->in_log = ce->dirty;
+    logged_cnt--;
+    if (ce->use_cnt == 0 && ce->pin_cnt == 0)
+    {
+      cond_signal (&c_evictable, &c_lock);
+    }
+  }
+  lock_release (&c_lock);
+}
+
+/* SECTOR was freed, whatever the journal holds of it doesn't
+ * matter anymore */
+void cache_log_forget (block_sector_t sector)
+{
+  struct cache_entry *ce;
+
+  lock_acquire (&c_lock);
+  ce = cache_find (sector);
+  if (ce != NULL)
+  {
+    if (ce->logged)
+    {
+      ce->logged = false;
+      logged_cnt--;
+      if (ce->use_cnt == 0 && ce->pin_cnt == 0)
+      {
+        cond_signal (&c_evictable, &c_lock);
+      }
+    }
+    ce->in_log = false;
+  }
+  lock_release (&c_lock);
+}
+
+/* Is SECTOR changed by a transaction that isn't committed yet? */
+bool cache_log_held (block_sector_t sector)
+{
+  struct cache_entry *ce;
+  bool logged;
+
+  lock_acquire (&c_lock);
+  ce = cache_find (sector);
+  logged = ce != NULL && ce->logged;
+  lock_release (&c_lock);
+  return logged;
+}
+
+/* Write back every entry committed to the journal, so that the log
+ * can be reused. Entries dirtied again meanwhile are written again. */
+void cache_checkpoint (void)
+{
+  struct list_elem *e;
+  bool left;
+
+  do
+  {
+    cache_flush (cache_pick_in_log, NULL);
+    left = false;
+    lock_acquire (&c_lock);
+    for (e = list_begin (&dirty_list); e != list_end (&dirty_list);
+         e = list_next (e))
+    {
+      struct cache_entry *ce = list_entry (e, struct cache_entry, dirty_elem);
+      if (ce->in_log && !ce->logged)
+      {
+        left = true;
+        break;
+      }
+    }
+    lock_release (&c_lock);
+  } while (left && !cache_closed);
+}
+
+/* Queue destruction */
+static void q_destroy (void)
+{
+  struct list_elem *e;
+  struct q_entry *qe;
+
+  lock_acquire (&q_lock);
+  q_closed = true;
+  while (!list_empty (&queue))
+  {
+    e = list_pop_front (&queue);
+    qe = list_entry (e, struct q_entry, elem);
+    free (qe);
+  }
+  lock_release (&q_lock);
+}
+
+/* Cache read at from sector plus offset to dst by size */
+off_t
+cache_read_at (void *dst, block_sector_t sector, off_t size, off_t offset)
+{
+  struct cache_entry *ce = cache_get_block (sector, false);
+
+  memcpy (dst, ce->data + offset, size); 
+  cache_release_block (ce, false);
+
+  return size;
+}
+
+/* Cache write from src to sector plus offset by size.
+ * OWNER is the inode sector the data belongs to */
+off_t
+cache_write_at (block_sector_t sector, void *src, off_t size, off_t offset,
+    block_sector_t owner)
+{
+  struct cache_entry *ce;
+
+  /* A write of the whole sector doesn't need the old contents */
+  if (offset == 0 && size == BLOCK_SECTOR_SIZE)
+  {
+    ce = cache_get_new_block (sector);
+  }
+  else
+  {
+    ce = cache_get_block (sector, true);
+  }
+  memcpy (ce->data + offset, src, size);
+  cache_mark_dirty (ce, owner);
+  cache_release_block (ce, true);
+
+  if (dirty_cnt > DIRTY_HIGH)
+  {
+    cache_throttle ();
+  }
+  
+  return size;
+}
+
+/* Zero SECTOR, a new data sector of the file in OWNER. File data
+ * stays out of the journal. */
+static void
+cache_zero_data (block_sector_t sector, block_sector_t owner)
+{
+  struct cache_entry *ce = cache_get_new_block (sector);
+
+  memset (ce->data, 0, BLOCK_SECTOR_SIZE);
+  cache_set_dirty (ce, owner);
+  cache_release_block (ce, true);
+}
+
+/* Write SECTOR back if it is cached and dirty, so the disk copy
+ * is current. Logged sectors can't be written yet and are left. */
+static void
+cache_flush_sector (block_sector_t sector)
+{
+  struct cache_entry *ce;
+
+  lock_acquire (&c_lock);
+  ce = cache_find (sector);
+  if (ce != NULL && ce->dirty && !ce->logged)
+  {
+    cache_write_back (ce);
+  }
+  lock_release (&c_lock);
+}
+
+/* Copy SECTOR to DST if a journal transaction holds it in the
+ * cache, whose copy is then newer than the disk's */
+static void
+cache_copy_logged (block_sector_t sector, void *dst)
+{
+  struct cache_entry *ce;
+
+  lock_acquire (&c_lock);
+  ce = cache_find (sector);
+  if (ce == NULL || !ce->logged)
+  {
+    lock_release (&c_lock);
+    return;
+  }
+  ce->use_cnt++;
+  lock_release (&c_lock);
+
+  cache_lock (ce, false);
+  /* It may have been committed and discarded while we waited */
+  if (ce->sector == sector && ce->dirty)
+  {
+    memcpy (dst, ce->data, BLOCK_SECTOR_SIZE);
+  }
+  cache_release_block (ce, false);
+}
+
+/* Drop any cached copy of SECTOR because the disk copy is being
+ * replaced behind the cache's back. A dirty copy is kept if
+ * KEEP_DIRTY, it holds somebody's newer write. */
+static void
+cache_invalidate (block_sector_t sector, bool keep_dirty)
+{
+  struct cache_entry *ce;
+
+  lock_acquire (&c_lock);
+  ce = cache_find (sector);
+  if (ce == NULL)
+  {
+    lock_release (&c_lock);
+    return;
+  }
+  ce->use_cnt++;
+  lock_release (&c_lock);
+
+  cache_lock (ce, true);
+  /* Pinned, but may have been discarded while we waited */
+  if (ce->sector == sector && !(keep_dirty && ce->dirty))
+  {
+    cache_discard (ce);
+  }
+  cache_release_block (ce, true);
+}
+
+/* Read CNT sectors starting at SECTOR straight from disk to DST,
+ * without caching them. Dirty cached copies are written back first
+ * so DST sees the latest data, and those the journal holds back
+ * are copied over what was read. DST must not page fault. */
+void
+cache_read_direct (void *dst, block_sector_t sector, block_sector_t cnt)
+{
+  block_sector_t i;
+
+  for (i = 0; i < cnt; i++)
+  {
+    cache_flush_sector (sector + i);
+  }
+  block_read_multiple (fs_device, sector, dst, cnt);
+  for (i = 0; i < cnt; i++)
+  {
+    cache_copy_logged (sector + i, (uint8_t *) dst + i * BLOCK_SECTOR_SIZE);
+  }
+}
+
+/* Write CNT sectors starting at SECTOR straight from SRC to disk,
+ * without caching them. Cached copies are dropped before the write
+ * so they can't be written over it later, and clean ones again
+ * after it in case a reader brought the old contents back in
+ * meanwhile.
+ * SRC must not page fault. */
+void
+cache_write_direct (block_sector_t sector, const void *src,
+    block_sector_t cnt)
+{
+  block_sector_t i;
+
+  for (i = 0; i < cnt; i++)
+  {
+    cache_invalidate (sector + i, false);
+  }
+  block_write_multiple (fs_device, sector, src, cnt);
+  for (i = 0; i < cnt; i++)
+  {
+    cache_invalidate (sector + i, true);
+  }
+}
+
+/* Close the Inode in given sector,
+ * so need to release corresponding sectors in free map */
+void cache_close_inode (block_sector_t sector)
+{
+  struct cache_entry *inode_ce = cache_get_block (sector, true);
+  struct inode_disk *inode_id = (struct inode_disk *) inode_ce->data;
+  off_t sector_remained = DIV_ROUND_UP (inode_id->length, BLOCK_SECTOR_SIZE);
+  
+  /* Write the free map once, at the end */
+  free_map_batch_begin ();
+  if (inode_id->magic == EXTENT_MAGIC)
+  {
+    cache_extent_release (inode_id);
+    sector_remained = 0;
+  }
+  /* Inline data goes with the inode sector */
+  if (inode_id->magic == INLINE_MAGIC)
+  {
+    sector_remained = 0;
+  }
+
+  /* Release direct blocks */
   off_t release_cnt = sector_remained < DIRECT_BLOCK ? sector_remained : DIRECT_BLOCK;
   int i;
   for (i = 0; i < release_cnt; i++)
@@ -386,7 +1764,7 @@ void cache_close_inode (block_sector_t sector)
   if (sector_remained > 0)
   {
     release_cnt = sector_remained < INDEX_BLOCK ? sector_remained : INDEX_BLOCK;
-    struct cache_entry *si_ce = cache_get_block (inode_id->indirect[0]);
+    struct cache_entry *si_ce = cache_get_block (inode_id->indirect[0], true);
     struct index_disk *si_id = (struct index_disk *) si_ce->data;
     int j;
     for (j = 0; j < release_cnt; j++)
@@ -395,28 +1773,22 @@ void cache_close_inode (block_sector_t sector)
       sector_remained--;
     }
     
-    if (si_ce->dirty)
-    {
-      /* Should not enter here, because we already write behind before this function call */
-      block_write (fs_device, si_ce->sector, si_id);
-    }
     free_map_release (inode_id->indirect[0], 1);
-    list_remove (&si_ce->elem);
-    free (si_ce->data);
-    free (si_ce);
+    cache_discard (si_ce);
+    cache_release_block (si_ce, true);
   }
 
   /* Release doubly indirect index blocks */
   if (sector_remained > 0)
   {
-    struct cache_entry *di_ce = cache_get_block (inode_id->doubly_indirect[0]);
+    struct cache_entry *di_ce = cache_get_block (inode_id->doubly_indirect[0], true);
     struct index_disk *di_id = (struct index_disk *) di_ce->data;
     
     int k = 0;
     while (sector_remained > 0)
     {
       /* Release doubly indirect index block's indirect index blocks */
-      struct cache_entry *dii_ce = cache_get_block (di_id->index[k]);
+      struct cache_entry *dii_ce = cache_get_block (di_id->index[k], true);
       struct index_disk *dii_id = (struct index_disk *) dii_ce->data;
       size_t di_cnt = INDEX_BLOCK > sector_remained ?
         sector_remained : INDEX_BLOCK;
@@ -428,84 +1800,141 @@ void cache_close_inode (block_sector_t sector)
       }
       free_map_release (di_id->index[k], 1);
       k++;
-      list_remove (&dii_ce->elem);
-      free (dii_ce->data);
-      free (dii_ce);
+      cache_discard (dii_ce);
+      cache_release_block (dii_ce, true);
     }
     free_map_release (inode_id->doubly_indirect[0], 1);
-    list_remove (&di_ce->elem);
-    free (di_ce->data);
-    free (di_ce);
+    cache_discard (di_ce);
+    cache_release_block (di_ce, true);
   }
   free_map_release (sector, 1);
-  list_remove (&inode_ce->elem);
-  free (inode_ce->data);
-  free (inode_ce);
+  free_map_batch_end ();
+  cache_discard (inode_ce);
+  cache_release_block (inode_ce, true);
 }
 
-/* Returns the length, in bytes, of inode's datain given SECTOR */
-off_t cache_inode_length (block_sector_t sector)
+/* Translate byte(offset) to sector with given inode in SECTOR */
+block_sector_t
+cache_byte_to_sector (block_sector_t sector, off_t offset)
 {
-  struct cache_entry *inode_ce = cache_get_block (sector);
-  struct inode_disk *inode_id = (struct inode_disk *) inode_ce->data;
-  off_t len = inode_id->length;
-  
-  inode_ce->use_cnt--;
-  return len;
+  block_sector_t cnt;
+
+  return cache_byte_to_run (sector, offset, &cnt);
 }
 
-/* Translate byte(offset) to sector with given inode in SECTOR */
+/* Like cache_byte_to_sector (), and stores in *CNT how many sectors
+ * of the file from OFFSET on are consecutive on disk, at least 1 */
 block_sector_t
-cache_byte_to_sector (block_sector_t sector, off_t offset)
+cache_byte_to_run (block_sector_t sector, off_t offset, block_sector_t *cnt)
 {
   /* Accesing inode disk */
-  struct cache_entry *inode_ce = cache_get_block (sector);
+  struct cache_entry *inode_ce = cache_get_block (sector, false);
   struct inode_disk *inode_id = (struct inode_disk *) inode_ce->data;
   struct inode_disk n_inode_id = *inode_id;
 
-  inode_ce->use_cnt--; 
-  
-  if (offset < n_inode_id.length)
+  cache_release_block (inode_ce, false);
+  return cache_map_lookup (&n_inode_id, offset, cnt);
+}
+
+/* Like cache_map_lookup (), but only if the answer is in ID itself.
+ * Returns false, having read nothing else, if an index or extent
+ * block would be needed. Each field is read once into a local and
+ * bounded by ID's own arrays, so ID may be a copy being rewritten
+ * meanwhile. The caller must then throw the answer away. */
+bool
+cache_map_try_lookup (const struct inode_disk *id, off_t offset,
+    block_sector_t *sector, block_sector_t *cnt)
+{
+  size_t index = offset / BLOCK_SECTOR_SIZE;
+  unsigned magic = id->magic;
+  uint32_t extent_cnt, i;
+
+  *cnt = 1;
+  if (offset >= id->length || magic == INLINE_MAGIC)
+  {
+    *sector = -1;
+    return true;
+  }
+  if (magic == EXTENT_MAGIC)
+  {
+    extent_cnt = id->extent_cnt;
+    if (extent_cnt > EXTENT_INLINE)
+    {
+      return false;
+    }
+    for (i = 0; i < extent_cnt; i++)
+    {
+      struct extent e = id->extents[i];
+
+      if (index < e.length)
+      {
+        *cnt = e.length - index;
+        *sector = e.start == EXTENT_HOLE ? EXTENT_HOLE : e.start + index;
+        return true;
+      }
+      index -= e.length;
+    }
+    return false;
+  }
+  if (magic == INODE_MAGIC && index < DIRECT_BLOCK)
+  {
+    *sector = id->direct[index];
+    return true;
+  }
+  return false;
+}
+
+/* Translate OFFSET to a sector and a run length in *CNT, like
+ * cache_byte_to_run (), with the inode already at hand in ID, which
+ * may be a copy. Only index blocks are read through the cache.
+ * Inline inodes have no data sectors, -1 is returned for them. */
+block_sector_t
+cache_map_lookup (const struct inode_disk *id, off_t offset,
+    block_sector_t *cnt)
+{
+  *cnt = 1;
+  if (offset < id->length && id->magic != INLINE_MAGIC)
   {
     /* Block index in data part of inode,
      * function should return sector which has this indexed data */
     size_t sector_index = offset / BLOCK_SECTOR_SIZE;  
+    /* Extents */
+    if (id->magic == EXTENT_MAGIC)
+    {
+      return cache_extent_find (id, sector_index, cnt);
+    }
     /* Direct block */ 
     if (sector_index < DIRECT_BLOCK)
     {
-      block_sector_t result = n_inode_id.direct[sector_index];
+      block_sector_t result = id->direct[sector_index];
       return result;
     } 
     
     /* Indirect block */
     else if (sector_index < DIRECT_BLOCK + INDEX_BLOCK)
     {
-      struct cache_entry *si_ce = cache_get_block (inode_id->indirect[0]);
+      struct cache_entry *si_ce = cache_get_block (id->indirect[0], false);
       struct index_disk *si_id = (struct index_disk *) si_ce->data;
-      struct index_disk n_si_id = *si_id;
-      si_ce->use_cnt--;
-      block_sector_t result = n_si_id.index[sector_index - DIRECT_BLOCK];
+      block_sector_t result = si_id->index[sector_index - DIRECT_BLOCK];
+      cache_release_block (si_ce, false);
       return result;
     }
     
     /* Dbouly indiriect block */
     else 
     {
-      struct cache_entry *di_ce = cache_get_block (inode_id->doubly_indirect[0]);
+      struct cache_entry *di_ce = cache_get_block (id->doubly_indirect[0], false);
       struct index_disk *di_id = (struct index_disk *) di_ce->data;
-      struct index_disk n_di_id = *di_id; 
-      di_ce->use_cnt--;
-
       size_t di_index = (sector_index - DIRECT_BLOCK - INDEX_BLOCK) / INDEX_BLOCK;
+      block_sector_t dii_sector = di_id->index[di_index];
+      cache_release_block (di_ce, false);
        
       /* Acessing doubly indirect indirect block */
-      struct cache_entry *dii_ce = cache_get_block (n_di_id.index[di_index]);
+      struct cache_entry *dii_ce = cache_get_block (dii_sector, false);
       struct index_disk *dii_id = (struct index_disk *) dii_ce->data;
-      struct index_disk n_dii_id = *dii_id;
-      dii_ce->use_cnt--;
-
-      block_sector_t result = n_dii_id.index[sector_index -DIRECT_BLOCK - INDEX_BLOCK -
+      block_sector_t result = dii_id->index[sector_index -DIRECT_BLOCK - INDEX_BLOCK -
         INDEX_BLOCK * (di_index)];
+      cache_release_block (dii_ce, false);
       return result;
     }
   }
@@ -515,13 +1944,43 @@ cache_byte_to_sector (block_sector_t sector, off_t offset)
   }
 }   
 
-/* Extend inode with given sector to length be a new_pos */
-void cache_inode_extend (block_sector_t sector, off_t new_pos)
+/* Extend inode with given sector to length be a new_pos.
+ * Extent inodes only record the new sectors as a hole, see
+ * cache_inode_fill (). Inline inodes that outgrow the inode become
+ * extent inodes. Returns false, leaving the inode as it was, if the
+ * disk or memory ran out. */
+bool cache_inode_extend (block_sector_t sector, off_t new_pos)
 {
   /* First find inode cache entry and inode inode disk */
-  struct cache_entry *inode_ce = cache_get_block (sector);
+  struct cache_entry *inode_ce = cache_get_block (sector, true);
   struct inode_disk *inode_id = (struct inode_disk *) inode_ce->data;
   
+  if (inode_id->magic == INLINE_MAGIC)
+  {
+    if (new_pos <= INODE_INLINE_MAX)
+    {
+      /* The bytes past the old length are zeros already */
+      if (new_pos > inode_id->length)
+      {
+        inode_id->length = new_pos;
+        cache_mark_dirty (inode_ce, sector);
+      }
+      cache_release_block (inode_ce, true);
+      return true;
+    }
+    if (!cache_inline_convert (inode_ce, sector))
+    {
+      cache_release_block (inode_ce, true);
+      return false;
+    }
+  }
+  if (inode_id->magic == EXTENT_MAGIC)
+  {
+    cache_extent_extend (inode_ce, new_pos, sector);
+    cache_release_block (inode_ce, true);
+    return true;
+  }
+
   /* Current sector length and needed sector length */
   size_t current_length = DIV_ROUND_UP (inode_id->length, BLOCK_SECTOR_SIZE);
   size_t needed_length = DIV_ROUND_UP (new_pos, BLOCK_SECTOR_SIZE);
@@ -531,6 +1990,48 @@ void cache_inode_extend (block_sector_t sector, off_t new_pos)
   {
     /* Zeros */
     static char zeros[BLOCK_SECTOR_SIZE];
+    /* Every sector the extension needs, data and index blocks,
+       taken before any is linked in so that running out of space
+       leaves the inode untouched */
+    block_sector_t *new_sectors;
+    size_t new_cnt = 0, taken = 0;
+    size_t l;
+    
+    for (l = current_length; l < needed_length; l++)
+    {
+      new_cnt++;
+      if (l == DIRECT_BLOCK || l == DIRECT_BLOCK + INDEX_BLOCK)
+      {
+        new_cnt++;
+      }
+      if (l >= DIRECT_BLOCK + INDEX_BLOCK
+          && (l - DIRECT_BLOCK - INDEX_BLOCK) % INDEX_BLOCK == 0)
+      {
+        new_cnt++;
+      }
+    }
+    new_sectors = malloc (new_cnt * sizeof *new_sectors);
+    if (new_sectors == NULL)
+    {
+      cache_release_block (inode_ce, true);
+      return false;
+    }
+    while (taken < new_cnt
+           && free_map_allocate_near (1, sector, &new_sectors[taken]))
+    {
+      taken++;
+    }
+    if (taken < new_cnt)
+    {
+      while (taken > 0)
+      {
+        free_map_release (new_sectors[--taken], 1);
+      }
+      free (new_sectors);
+      cache_release_block (inode_ce, true);
+      return false;
+    }
+    taken = 0;
     
     /* Extend ext_cnt blocks */
     int i;
@@ -539,9 +2040,9 @@ void cache_inode_extend (block_sector_t sector, off_t new_pos)
       /* Next block is direct block */
       if (current_length < DIRECT_BLOCK)
       {
-        free_map_allocate (1, &inode_id->direct[current_length]);
-        inode_ce->dirty = true;
-        cache_write_at (inode_id->direct[current_length], zeros, BLOCK_SECTOR_SIZE, 0);
+        inode_id->direct[current_length] = new_sectors[taken++];
+        cache_mark_dirty (inode_ce, sector);
+        cache_write_at (inode_id->direct[current_length], zeros, BLOCK_SECTOR_SIZE, 0, sector);
       }
       /* Next block is indirect block */
       else if (current_length < DIRECT_BLOCK + INDEX_BLOCK)
@@ -549,21 +2050,17 @@ void cache_inode_extend (block_sector_t sector, off_t new_pos)
         /* Need to allocate single indirect index disk block */
         if (current_length == DIRECT_BLOCK)
         {
-          struct index_disk *si_id = calloc (1, sizeof *si_id);
-          if (si_id != NULL)
-          {
-            free_map_allocate (1, &inode_id->indirect[0]);
-            inode_ce->dirty = true;
-            cache_write_at (inode_id->indirect[0], si_id, BLOCK_SECTOR_SIZE, 0);
-          }
+          inode_id->indirect[0] = new_sectors[taken++];
+          cache_mark_dirty (inode_ce, sector);
+          cache_write_at (inode_id->indirect[0], zeros, BLOCK_SECTOR_SIZE, 0, sector);
         }
-        struct cache_entry *si_ce = cache_get_block (inode_id->indirect[0]);
+        struct cache_entry *si_ce = cache_get_block (inode_id->indirect[0], true);
         
         struct index_disk *si_id = (struct index_disk *) si_ce->data;
-        free_map_allocate (1, &si_id->index[current_length - DIRECT_BLOCK]);
-        si_ce->dirty = true;
-        cache_write_at (si_id->index[current_length - DIRECT_BLOCK], zeros, BLOCK_SECTOR_SIZE, 0);
-        si_ce->use_cnt--;
+        si_id->index[current_length - DIRECT_BLOCK] = new_sectors[taken++];
+        cache_mark_dirty (si_ce, sector);
+        cache_write_at (si_id->index[current_length - DIRECT_BLOCK], zeros, BLOCK_SECTOR_SIZE, 0, sector);
+        cache_release_block (si_ce, true);
       }
       /* Next block is doubly indirect block */
       else
@@ -571,60 +2068,748 @@ void cache_inode_extend (block_sector_t sector, off_t new_pos)
         /* Need to allocate doubly indirect index disk block */
         if (current_length == DIRECT_BLOCK + INDEX_BLOCK)
         {
-          struct index_disk *di_id = calloc (1, sizeof *di_id);
-          if (di_id != NULL)
-          {
-            free_map_allocate (1, &inode_id->doubly_indirect[0]);
-            inode_ce->dirty = true;
-            cache_write_at (inode_id->doubly_indirect[0], di_id, BLOCK_SECTOR_SIZE, 0);
-          }
+          inode_id->doubly_indirect[0] = new_sectors[taken++];
+          cache_mark_dirty (inode_ce, sector);
+          cache_write_at (inode_id->doubly_indirect[0], zeros, BLOCK_SECTOR_SIZE, 0, sector);
         }
         /* Determine we need to allocate doubly indirect indirect index disk block */ 
         size_t index = (current_length - DIRECT_BLOCK - INDEX_BLOCK) / INDEX_BLOCK;
         size_t remainder = (current_length - DIRECT_BLOCK - INDEX_BLOCK) % INDEX_BLOCK;
-        struct cache_entry *di_ce = cache_get_block (inode_id->doubly_indirect[0]);
+        struct cache_entry *di_ce = cache_get_block (inode_id->doubly_indirect[0], true);
         struct index_disk *di_id  = (struct index_disk *) di_ce->data;
         
         /* Doubly indirect indirect index disk block is needed */
         if (remainder == 0)
         {
-          struct index_disk *dii_id  = calloc (1, sizeof *dii_id);
-          if (dii_id != NULL)
-          {
-            free_map_allocate (1, &di_id->index[index]);
-            di_ce->dirty = true;
-            cache_write_at (di_id->index[index], dii_id, BLOCK_SECTOR_SIZE, 0);
-          }
+          di_id->index[index] = new_sectors[taken++];
+          cache_mark_dirty (di_ce, sector);
+          cache_write_at (di_id->index[index], zeros, BLOCK_SECTOR_SIZE, 0, sector);
         }
         
-        struct cache_entry *dii_ce = cache_get_block (di_id->index[index]);
-        di_ce->use_cnt--;
+        struct cache_entry *dii_ce = cache_get_block (di_id->index[index], true);
+        cache_release_block (di_ce, true);
         struct index_disk *dii_id = (struct index_disk *) dii_ce->data;
-        free_map_allocate (1, &dii_id->index[current_length - DIRECT_BLOCK - INDEX_BLOCK * index - INDEX_BLOCK]);
-        dii_ce->dirty = true;
-        cache_write_at (dii_id->index[current_length - DIRECT_BLOCK - INDEX_BLOCK *index - INDEX_BLOCK],
-            zeros, BLOCK_SECTOR_SIZE, 0);
-        dii_ce->use_cnt--;
+        dii_id->index[remainder] = new_sectors[taken++];
+        cache_mark_dirty (dii_ce, sector);
+        cache_write_at (dii_id->index[remainder], zeros, BLOCK_SECTOR_SIZE, 0, sector);
+        cache_release_block (dii_ce, true);
       }   
       current_length++; 
     }
+    ASSERT (taken == new_cnt);
+    free (new_sectors);
   }
   /* Update inode length */
   if (new_pos > inode_id->length)
   {
-    //printf ("[cache_inode_extend] sector: %d, new position: %d\n", sector, new_pos);
     inode_id->length = new_pos;
-    inode_ce->dirty = true;
+    cache_mark_dirty (inode_ce, sector);
+  }
+  cache_release_block (inode_ce, true);
+  return true;
+}
+
+/* Allocate the first run of sectors under bytes OFFSET to OFFSET +
+ * SIZE of the inode in SECTOR that is still a hole, out of PREALLOC
+ * first if not NULL, and store in *NEXT the offset after it, so
+ * that the caller can go on from there in another journal handle.
+ * *NEXT is OFFSET + SIZE or past it if there was no hole. The
+ * caller is about to write those bytes, so only sectors they, or
+ * the inode's length, cover in part are zeroed. Only extent inodes
+ * have holes. Returns false if the disk is full. */
+bool
+cache_inode_fill (block_sector_t sector, off_t offset, off_t size,
+    struct extent *prealloc, off_t *next)
+{
+  struct cache_entry *inode_ce = cache_get_block (sector, true);
+  struct inode_disk *inode_id = (struct inode_disk *) inode_ce->data;
+  size_t end = DIV_ROUND_UP (offset + size, BLOCK_SECTOR_SIZE);
+  off_t written_end = offset + size;
+  bool success = true;
+
+  *next = offset + size;
+  if (written_end > inode_id->length)
+  {
+    written_end = inode_id->length;
+  }
+  if (inode_id->magic == EXTENT_MAGIC && size > 0)
+  {
+    size_t index;
+
+    success = cache_extent_fill (inode_ce, offset / BLOCK_SECTOR_SIZE, end,
+        DIV_ROUND_UP (offset, BLOCK_SECTOR_SIZE),
+        written_end / BLOCK_SECTOR_SIZE, sector, prealloc, &index);
+    if (success)
+    {
+      *next = index * BLOCK_SECTOR_SIZE;
+    }
+  }
+  cache_release_block (inode_ce, true);
+  return success;
+}
+
+/* Shrink the inode in SECTOR to LENGTH bytes, giving back the
+ * sectors past it with a single write of the free map. The rest of
+ * the last sector kept is zeroed in case the file grows again. Only
+ * extent and inline inodes can shrink, returns false for others. */
+bool
+cache_inode_truncate (block_sector_t sector, off_t length)
+{
+  static char zeros[BLOCK_SECTOR_SIZE];
+  struct cache_entry *inode_ce = cache_get_block (sector, true);
+  struct inode_disk *inode_id = (struct inode_disk *) inode_ce->data;
+  int ofs = length % BLOCK_SECTOR_SIZE;
+
+  if (inode_id->magic == INLINE_MAGIC)
+  {
+    if (length < inode_id->length)
+    {
+      memset (inode_id->data + length, 0, inode_id->length - length);
+      inode_id->length = length;
+      cache_mark_dirty (inode_ce, sector);
+    }
+    cache_release_block (inode_ce, true);
+    return true;
+  }
+  if (inode_id->magic != EXTENT_MAGIC)
+  {
+    cache_release_block (inode_ce, true);
+    return false;
+  }
+  if (length < inode_id->length)
+  {
+    if (ofs != 0)
+    {
+      block_sector_t cnt;
+      block_sector_t last = cache_extent_find (inode_id,
+          length / BLOCK_SECTOR_SIZE, &cnt);
+
+      if (last != EXTENT_HOLE)
+      {
+        cache_write_at (last, zeros, BLOCK_SECTOR_SIZE - ofs, ofs, sector);
+      }
+    }
+    free_map_batch_begin ();
+    cache_extent_truncate (inode_ce, DIV_ROUND_UP (length, BLOCK_SECTOR_SIZE),
+        sector);
+    free_map_batch_end ();
+    inode_id->length = length;
+    cache_mark_dirty (inode_ce, sector);
+  }
+  cache_release_block (inode_ce, true);
+  return true;
+}
+
+/* Turn the inline inode in INODE_CE, locked exclusively, into an
+ * extent inode of the same length. Its data moves to a sector of
+ * its own near the inode, if there is any data. Returns false,
+ * leaving the inode as it was, if the disk is full. */
+static bool
+cache_inline_convert (struct cache_entry *inode_ce, block_sector_t owner)
+{
+  static char zeros[BLOCK_SECTOR_SIZE];
+  struct inode_disk *id = (struct inode_disk *) inode_ce->data;
+  block_sector_t data = EXTENT_HOLE;
+  off_t length = id->length;
+
+  ASSERT (id->magic == INLINE_MAGIC);
+  if (length > 0)
+  {
+    if (!free_map_allocate_near (1, owner, &data))
+    {
+      return false;
+    }
+    cache_write_at (data, zeros, BLOCK_SECTOR_SIZE, 0, owner);
+    cache_write_at (data, id->data, length, 0, owner);
+  }
+  memset (id->data, 0, sizeof id->data);
+  id->magic = EXTENT_MAGIC;
+  if (length > 0)
+  {
+    id->extent_cnt = 1;
+    id->extents[0].start = data;
+    id->extents[0].length = 1;
+  }
+  cache_mark_dirty (inode_ce, owner);
+  return true;
+}
+
+/* Sector of the INDEX-th sector of the file with extent inode ID,
+ * EXTENT_HOLE if it lies in a hole, -1 if there is none. *CNT is set
+ * to the number of sectors left in the extent from there on. */
+static block_sector_t
+cache_extent_find (const struct inode_disk *id, size_t index,
+    block_sector_t *cnt)
+{
+  block_sector_t next = id->extent_next;
+  uint32_t i;
+
+  for (i = 0; i < id->extent_cnt; i++)
+  {
+    if (index < id->extents[i].length)
+    {
+      *cnt = id->extents[i].length - index;
+      if (id->extents[i].start == EXTENT_HOLE)
+      {
+        return EXTENT_HOLE;
+      }
+      return id->extents[i].start + index;
+    }
+    index -= id->extents[i].length;
+  }
+  while (next != 0)
+  {
+    struct cache_entry *ce = cache_get_block (next, false);
+    struct extent_disk *ed = (struct extent_disk *) ce->data;
+    block_sector_t result = -1;
+
+    for (i = 0; i < ed->extent_cnt; i++)
+    {
+      if (index < ed->extents[i].length)
+      {
+        *cnt = ed->extents[i].length - index;
+        result = ed->extents[i].start == EXTENT_HOLE
+                 ? EXTENT_HOLE : ed->extents[i].start + index;
+        break;
+      }
+      index -= ed->extents[i].length;
+    }
+    next = ed->next;
+    cache_release_block (ce, false);
+    if (result != (block_sector_t) -1)
+    {
+      return result;
+    }
+  }
+  return -1;
+}
+
+/* The extents of one block in the chain of an extent inode, which is
+ * either the inode itself or an extent_disk, locked exclusively */
+struct extent_array
+  {
+    struct cache_entry *ce;             /* Block holding the extents */
+    uint32_t *cnt;                      /* Extents used */
+    struct extent *extents;
+    uint32_t max;                       /* Room in EXTENTS */
+    block_sector_t *next;               /* Next block, 0 if none */
+  };
+
+/* Point A at the extents in CE, of the inode itself if INLINE_ */
+static void
+cache_extent_array (struct cache_entry *ce, bool inline_,
+    struct extent_array *a)
+{
+  a->ce = ce;
+  if (inline_)
+  {
+    struct inode_disk *id = (struct inode_disk *) ce->data;
+
+    a->cnt = &id->extent_cnt;
+    a->extents = id->extents;
+    a->max = EXTENT_INLINE;
+    a->next = &id->extent_next;
+  }
+  else
+  {
+    struct extent_disk *ed = (struct extent_disk *) ce->data;
+
+    a->cnt = &ed->extent_cnt;
+    a->extents = ed->extents;
+    a->max = EXTENT_BLOCK;
+    a->next = &ed->next;
+  }
+}
+
+/* Move A on to the next block of the chain of the inode in INODE_CE,
+ * which must exist */
+static void
+cache_extent_next (struct cache_entry *inode_ce, struct extent_array *a)
+{
+  struct cache_entry *next_ce = cache_get_block (*a->next, true);
+
+  cache_extent_put (inode_ce, a);
+  cache_extent_array (next_ce, false, a);
+}
+
+/* Unlock A's block unless it is the inode in INODE_CE */
+static void
+cache_extent_put (struct cache_entry *inode_ce, struct extent_array *a)
+{
+  if (a->ce != inode_ce)
+  {
+    cache_release_block (a->ce, true);
+  }
+}
+
+/* Point A at the block of the extent inode in INODE_CE that maps the
+ * INDEX-th sector of the file, *SLOT at the extent in it and *SKIP at
+ * how far into the extent the sector is. Returns false, with only
+ * INODE_CE locked, if the file has no such sector. */
+static bool
+cache_extent_locate (struct cache_entry *inode_ce, size_t index,
+    struct extent_array *a, uint32_t *slot, size_t *skip)
+{
+  cache_extent_array (inode_ce, true, a);
+  for (;;)
+  {
+    uint32_t i;
+
+    for (i = 0; i < *a->cnt; i++)
+    {
+      if (index < a->extents[i].length)
+      {
+        *slot = i;
+        *skip = index;
+        return true;
+      }
+      index -= a->extents[i].length;
+    }
+    if (*a->next == 0)
+    {
+      break;
+    }
+    cache_extent_next (inode_ce, a);
+  }
+  cache_extent_put (inode_ce, a);
+  return false;
+}
+
+/* Whether a run starting at START carries on from extent E, on disk
+ * or as both being holes */
+static bool
+cache_extent_continues (const struct extent *e, block_sector_t start)
+{
+  if (e->start == EXTENT_HOLE || start == EXTENT_HOLE)
+  {
+    return e->start == start;
+  }
+  return e->start + e->length == start;
+}
+
+/* Insert E as the POS-th extent of A's block. If the block is full a
+ * new extent_disk is linked in right after it to take the overflow,
+ * which is E itself if POS is past the end. Returns false, changing
+ * nothing, if there was no sector for that. */
+static bool
+cache_extent_insert (struct extent_array *a, uint32_t pos, struct extent e,
+    block_sector_t owner)
+{
+  ASSERT (pos <= *a->cnt);
+
+  if (*a->cnt == a->max)
+  {
+    struct cache_entry *new_ce;
+    struct extent_disk *ed;
+    block_sector_t sector;
+
+    if (!free_map_allocate_near (1, owner, &sector))
+    {
+      return false;
+    }
+    new_ce = cache_get_new_block (sector);
+    ed = (struct extent_disk *) new_ce->data;
+    memset (ed, 0, BLOCK_SECTOR_SIZE);
+    ed->extent_cnt = 1;
+    ed->extents[0] = pos == a->max ? e : a->extents[a->max - 1];
+    ed->next = *a->next;
+    *a->next = sector;
+    cache_mark_dirty (new_ce, owner);
+    cache_release_block (new_ce, true);
+    cache_mark_dirty (a->ce, owner);
+    if (pos == a->max)
+    {
+      return true;
+    }
+    (*a->cnt)--;
+  }
+  memmove (&a->extents[pos + 1], &a->extents[pos],
+      (*a->cnt - pos) * sizeof e);
+  a->extents[pos] = e;
+  (*a->cnt)++;
+  cache_mark_dirty (a->ce, owner);
+  return true;
+}
+
+/* Remove the POS-th extent of A's block. The caller marks it dirty. */
+static void
+cache_extent_delete (struct extent_array *a, uint32_t pos)
+{
+  ASSERT (pos < *a->cnt);
+
+  memmove (&a->extents[pos], &a->extents[pos + 1],
+      (*a->cnt - pos - 1) * sizeof *a->extents);
+  (*a->cnt)--;
+}
+
+/* Merge the POS-th extent of A's block into the ones around it in the
+ * same block, where they carry on from each other */
+static void
+cache_extent_merge (struct extent_array *a, uint32_t pos)
+{
+  if (pos + 1 < *a->cnt
+      && cache_extent_continues (&a->extents[pos], a->extents[pos + 1].start))
+  {
+    a->extents[pos].length += a->extents[pos + 1].length;
+    cache_extent_delete (a, pos + 1);
+  }
+  if (pos > 0
+      && cache_extent_continues (&a->extents[pos - 1], a->extents[pos].start))
+  {
+    a->extents[pos - 1].length += a->extents[pos].length;
+    cache_extent_delete (a, pos);
+  }
+}
+
+/* Map CNT sectors, SKIP sectors into the hole that is the SLOT-th
+ * extent of A, to the run starting at START. The hole is split in up
+ * to three. Returns false if there was no room for the pieces, with
+ * the sectors still a hole. */
+static bool
+cache_extent_split (struct extent_array *a, uint32_t slot, size_t skip,
+    block_sector_t start, block_sector_t cnt, block_sector_t owner)
+{
+  block_sector_t after = a->extents[slot].length - skip - cnt;
+  struct extent piece;
+
+  ASSERT (a->extents[slot].start == EXTENT_HOLE);
+
+  /* Hole after the run */
+  if (after > 0)
+  {
+    piece.start = EXTENT_HOLE;
+    piece.length = after;
+    if (!cache_extent_insert (a, slot + 1, piece, owner))
+    {
+      return false;
+    }
+    a->extents[slot].length -= after;
+  }
+  /* Hole before the run stays in SLOT, the run goes right after */
+  if (skip > 0)
+  {
+    piece.start = start;
+    piece.length = cnt;
+    if (!cache_extent_insert (a, slot + 1, piece, owner))
+    {
+      return false;
+    }
+    a->extents[slot].length = skip;
+    slot++;
+  }
+  else
+  {
+    a->extents[slot].start = start;
+  }
+  if (slot < a->max)
+  {
+    cache_extent_merge (a, slot);
+  }
+  cache_mark_dirty (a->ce, owner);
+  return true;
+}
+
+/* Add LEN sectors starting at START, or a hole of LEN sectors if
+ * START is EXTENT_HOLE, to the end of the extent inode in INODE_CE,
+ * which must be locked exclusively. The run is merged into the last
+ * extent if it carries on from it. Returns false if the extents were
+ * full and no block could be chained for more. */
+static bool
+cache_extent_append (struct cache_entry *inode_ce, block_sector_t start,
+    block_sector_t len, block_sector_t owner)
+{
+  struct extent_array a;
+  struct extent e;
+  bool success = true;
+
+  /* The last extent is in the last block of the chain */
+  cache_extent_array (inode_ce, true, &a);
+  while (*a.next != 0)
+  {
+    cache_extent_next (inode_ce, &a);
+  }
+
+  if (*a.cnt > 0 && cache_extent_continues (&a.extents[*a.cnt - 1], start))
+  {
+    a.extents[*a.cnt - 1].length += len;
+    cache_mark_dirty (a.ce, owner);
+  }
+  else
+  {
+    e.start = start;
+    e.length = len;
+    success = cache_extent_insert (&a, *a.cnt, e, owner);
+  }
+  cache_extent_put (inode_ce, &a);
+  return success;
+}
+
+/* Least and most sectors reserved ahead of a growing file */
+#define PREALLOC_MIN 8
+#define PREALLOC_MAX 64
+
+/* Reserve at least CNT sectors for the INDEX-th sector on of an
+ * extent inode into PREALLOC. Farther into the file more is
+ * reserved, up to PREALLOC_MAX sectors. The run is looked for at
+ * GOAL first, see free_map_allocate_near (). PREALLOC is left empty
+ * if there is no contiguous room for CNT sectors. */
+static void
+cache_extent_reserve (size_t index, size_t cnt, block_sector_t goal,
+    struct extent *prealloc)
+{
+  size_t want = index < PREALLOC_MIN ? PREALLOC_MIN
+                : index > PREALLOC_MAX ? PREALLOC_MAX : index;
+  block_sector_t start;
+
+  if (want < cnt)
+  {
+    want = cnt;
+  }
+  prealloc->length = 0;
+  for (; want >= cnt && want > 0; want /= 2)
+  {
+    if (free_map_allocate_near (want, goal, &start))
+    {
+      prealloc->start = start;
+      prealloc->length = want;
+      return;
+    }
+  }
+}
+
+/* Take a run of up to CNT sectors for the INDEX-th sector on of an
+ * extent inode into *START, out of PREALLOC if not NULL, refilling it
+ * when it runs out, or else straight from the free map, as long as
+ * possible and close to GOAL. Returns the length of the run, 0 if
+ * the disk is full. */
+static block_sector_t
+cache_extent_take (size_t index, block_sector_t cnt, block_sector_t goal,
+    struct extent *prealloc, block_sector_t *start)
+{
+  if (prealloc != NULL && prealloc->length == 0)
+  {
+    cache_extent_reserve (index, cnt, goal, prealloc);
+  }
+  if (prealloc != NULL && prealloc->length > 0)
+  {
+    if (cnt > prealloc->length)
+    {
+      cnt = prealloc->length;
+    }
+    *start = prealloc->start;
+    prealloc->start += cnt;
+    prealloc->length -= cnt;
+    return cnt;
+  }
+  while (cnt > 0 && !free_map_allocate_near (cnt, goal, start))
+  {
+    cnt /= 2;
+  }
+  return cnt;
+}
+
+/* Grow the extent inode in INODE_CE, locked exclusively, to NEW_POS
+ * bytes. The new sectors are a hole, and read as zeros, until
+ * cache_extent_fill () gives them sectors. */
+static void
+cache_extent_extend (struct cache_entry *inode_ce, off_t new_pos,
+    block_sector_t owner)
+{
+  struct inode_disk *id = (struct inode_disk *) inode_ce->data;
+  size_t have = DIV_ROUND_UP (id->length, BLOCK_SECTOR_SIZE);
+  size_t need = DIV_ROUND_UP (new_pos, BLOCK_SECTOR_SIZE);
+
+  if (new_pos <= id->length)
+  {
+    return;
+  }
+  if (need > have
+      && !cache_extent_append (inode_ce, EXTENT_HOLE, need - have, owner))
+  {
+    return;
+  }
+  id->length = new_pos;
+  cache_mark_dirty (inode_ce, owner);
+}
+
+/* Give a run of sectors, taken with cache_extent_take (), to the
+ * first hole among sectors FIRST to END of the extent inode in
+ * INODE_CE, locked exclusively. Those from WHOLE_FIRST to WHOLE_END
+ * are about to be overwritten in full and are left as they are, the
+ * rest are zeroed. Stores in *NEXT the sector after the run, END if
+ * there was no hole. Returns false if the disk is full. */
+static bool
+cache_extent_fill (struct cache_entry *inode_ce, size_t first, size_t end,
+    size_t whole_first, size_t whole_end, block_sector_t owner,
+    struct extent *prealloc, size_t *next)
+{
+  size_t index = first;
+
+  while (index < end)
+  {
+    struct extent_array a;
+    struct extent *e;
+    block_sector_t goal = owner;
+    block_sector_t start, cnt, i;
+    uint32_t slot;
+    size_t skip;
+
+    if (!cache_extent_locate (inode_ce, index, &a, &slot, &skip))
+    {
+      return false;
+    }
+    e = &a.extents[slot];
+    cnt = e->length - skip;
+    if (e->start != EXTENT_HOLE)
+    {
+      cache_extent_put (inode_ce, &a);
+      index += cnt;
+      continue;
+    }
+    if (cnt > end - index)
+    {
+      cnt = end - index;
+    }
+    /* Best right after the sector before, if it is in this block,
+     * or else near the inode itself */
+    if (skip == 0 && slot > 0 && e[-1].start != EXTENT_HOLE)
+    {
+      goal = e[-1].start + e[-1].length;
+    }
+    cnt = cache_extent_take (index, cnt, goal, prealloc, &start);
+    if (cnt == 0)
+    {
+      cache_extent_put (inode_ce, &a);
+      return false;
+    }
+    for (i = 0; i < cnt; i++)
+    {
+      if (index + i < whole_first || index + i >= whole_end)
+      {
+        cache_zero_data (start + i, owner);
+      }
+    }
+    if (!cache_extent_split (&a, slot, skip, start, cnt, owner))
+    {
+      free_map_release (start, cnt);
+      cache_extent_put (inode_ce, &a);
+      return false;
+    }
+    cache_extent_put (inode_ce, &a);
+    *next = index + cnt;
+    return true;
+  }
+  *next = end;
+  return true;
+}
+
+/* Give back the sectors of extent E from the SKIP-th on, unless it
+ * is a hole. Cached copies are dropped so that dead data isn't
+ * written back. */
+static void
+cache_extent_free (const struct extent *e, block_sector_t skip)
+{
+  block_sector_t i;
+
+  if (e->start == EXTENT_HOLE || skip >= e->length)
+  {
+    return;
+  }
+  for (i = skip; i < e->length; i++)
+  {
+    cache_invalidate (e->start + i, false);
+  }
+  free_map_release (e->start + skip, e->length - skip);
+}
+
+/* Release the data sectors and extent blocks of extent inode ID */
+static void
+cache_extent_release (struct inode_disk *id)
+{
+  uint32_t i;
+
+  for (i = 0; i < id->extent_cnt; i++)
+  {
+    cache_extent_free (&id->extents[i], 0);
+  }
+  cache_extent_release_chain (id->extent_next);
+}
+
+/* Release the extent blocks in the chain starting at NEXT, 0 if
+ * none, and the data sectors they map */
+static void
+cache_extent_release_chain (block_sector_t next)
+{
+  uint32_t i;
+
+  while (next != 0)
+  {
+    struct cache_entry *ce = cache_get_block (next, true);
+    struct extent_disk *ed = (struct extent_disk *) ce->data;
+
+    for (i = 0; i < ed->extent_cnt; i++)
+    {
+      cache_extent_free (&ed->extents[i], 0);
+    }
+    free_map_release (next, 1);
+    next = ed->next;
+    cache_discard (ce);
+    cache_release_block (ce, true);
   }
-  //printf ("end of cache inode extend\n");
-  inode_ce->use_cnt--;
 }
 
-enum inode_type cache_get_type (block_sector_t sector)
+/* Cut the extent inode in INODE_CE, locked exclusively, down to its
+ * first KEEP sectors. Extent blocks left with nothing to map are
+ * released along with the sectors. */
+static void
+cache_extent_truncate (struct cache_entry *inode_ce, size_t keep,
+    block_sector_t owner)
 {
-  struct cache_entry *ce = cache_get_block (sector);
-  struct inode_disk *id = (struct inode_disk *) ce->data;
-  enum inode_type t = id->type;
-  ce->use_cnt--;
-  return t;
+  struct extent_array a;
+  block_sector_t next;
+
+  cache_extent_array (inode_ce, true, &a);
+  for (;;)
+  {
+    uint32_t i, used = 0;
+
+    for (i = 0; i < *a.cnt; i++)
+    {
+      struct extent *e = &a.extents[i];
+
+      if (keep >= e->length)
+      {
+        keep -= e->length;
+        used++;
+      }
+      else
+      {
+        cache_extent_free (e, keep);
+        if (keep > 0)
+        {
+          e->length = keep;
+          keep = 0;
+          used++;
+        }
+      }
+    }
+    if (used < *a.cnt)
+    {
+      *a.cnt = used;
+      cache_mark_dirty (a.ce, owner);
+    }
+    if (keep == 0 || *a.next == 0)
+    {
+      break;
+    }
+    cache_extent_next (inode_ce, &a);
+  }
+  next = *a.next;
+  if (next != 0)
+  {
+    *a.next = 0;
+    cache_mark_dirty (a.ce, owner);
+  }
+  cache_extent_put (inode_ce, &a);
+  cache_extent_release_chain (next);
 }
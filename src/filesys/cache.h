@@ -6,20 +6,45 @@
 #include "devices/block.h"
 #include "filesys/off_t.h"
 
+struct extent;
+struct inode_disk;
+
 struct lock c_lock;
 
+bool cache_set_policy (const char *name);
+bool cache_set_size (int);
+bool cache_set_flush_age (int);
+void cache_print_stats (void);
 void cache_init (void);
 void cache_destroy (void);
-//void read_aheader_func (void);
-//void flusher_func (void);
+void read_aheader_func (void *aux);
+void flusher_func (void *aux);
 void cache_write_behind (void);
-//void q_destroy (void);
-off_t cache_read_at (void*, block_sector_t sector, off_t size,
-    off_t offset, block_sector_t next_sector, bool ahead);
-off_t cache_write_at (block_sector_t, void*, off_t size, off_t offset);
+void cache_read_ahead (block_sector_t);
+int cache_read_ahead_window (void);
+off_t cache_read_at (void*, block_sector_t sector, off_t size, off_t offset);
+off_t cache_write_at (block_sector_t, void*, off_t size, off_t offset,
+    block_sector_t owner);
+void cache_read_direct (void *, block_sector_t, block_sector_t cnt);
+void cache_write_direct (block_sector_t, const void *, block_sector_t cnt);
+void cache_flush_inode (block_sector_t owner);
+bool cache_pin (block_sector_t);
+void cache_unpin (block_sector_t);
 void cache_close_inode (block_sector_t);
-off_t cache_inode_length (block_sector_t);
 block_sector_t cache_byte_to_sector (block_sector_t, off_t);
-void cache_inode_extend (block_sector_t, off_t);
-enum inode_type cache_get_type (block_sector_t sector);
+block_sector_t cache_byte_to_run (block_sector_t, off_t, block_sector_t *cnt);
+block_sector_t cache_map_lookup (const struct inode_disk *, off_t,
+                                 block_sector_t *cnt);
+bool cache_map_try_lookup (const struct inode_disk *, off_t,
+                           block_sector_t *sector, block_sector_t *cnt);
+bool cache_inode_extend (block_sector_t, off_t);
+bool cache_inode_fill (block_sector_t, off_t offset, off_t size,
+                       struct extent *prealloc, off_t *next);
+bool cache_inode_truncate (block_sector_t, off_t);
+int cache_log_max (void);
+bool cache_log_copy (block_sector_t, void *);
+void cache_log_done (block_sector_t);
+void cache_log_forget (block_sector_t);
+bool cache_log_held (block_sector_t);
+void cache_checkpoint (void);
 #endif /* filesys/cache.h */
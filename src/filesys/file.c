@@ -10,6 +10,7 @@ struct file
     struct inode *inode;        /* File's inode. */
     off_t pos;                  /* Current position. */
     bool deny_write;            /* Has file_deny_write() been called? */
+    bool direct;                /* Bypass the buffer cache? */
   };
 
 /* Opens a file for the given INODE, of which it takes ownership,
@@ -25,6 +26,7 @@ file_open (struct inode *inode)
       file->inode = inode;
       file->pos = 0;
       file->deny_write = false;
+      file->direct = false;
       return file;
     }
   else
@@ -71,7 +73,7 @@ off_t
 file_read (struct file *file, void *buffer, off_t size) 
 {
   //printf ("[file_read] file inode sector : %d, size: %d\n", file->inode->sector, size);
-  off_t bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
+  off_t bytes_read = file_read_at (file, buffer, size, file->pos);
   file->pos += bytes_read;
   return bytes_read;
 }
@@ -84,6 +86,8 @@ file_read (struct file *file, void *buffer, off_t size)
 off_t
 file_read_at (struct file *file, void *buffer, off_t size, off_t file_ofs) 
 {
+  if (file->direct)
+    return inode_read_direct_at (file->inode, buffer, size, file_ofs);
   return inode_read_at (file->inode, buffer, size, file_ofs);
 }
 
@@ -97,7 +101,7 @@ file_read_at (struct file *file, void *buffer, off_t size, off_t file_ofs)
 off_t
 file_write (struct file *file, const void *buffer, off_t size) 
 {
-  off_t bytes_written = inode_write_at (file->inode, buffer, size, file->pos);
+  off_t bytes_written = file_write_at (file, buffer, size, file->pos);
   file->pos += bytes_written;
   return bytes_written;
 }
@@ -113,9 +117,50 @@ off_t
 file_write_at (struct file *file, const void *buffer, off_t size,
                off_t file_ofs) 
 {
+  if (file->direct)
+    return inode_write_direct_at (file->inode, buffer, size, file_ofs);
   return inode_write_at (file->inode, buffer, size, file_ofs);
 }
 
+/* Writes SIZE bytes from BUFFER into FILE at its current position
+   through the buffer cache, even if FILE is direct, and advances
+   the position. Returns the number of bytes written. */
+off_t
+file_write_cached (struct file *file, const void *buffer, off_t size) 
+{
+  off_t bytes_written = inode_write_at (file->inode, buffer, size,
+                                        file->pos);
+  file->pos += bytes_written;
+  return bytes_written;
+}
+
+/* Writes FILE's data that is still only in the buffer cache
+   to disk. */
+void
+file_sync (struct file *file) 
+{
+  ASSERT (file != NULL);
+  inode_sync (file->inode);
+}
+
+/* Makes reads and writes of whole sectors through FILE go
+   straight between the caller's buffer and the disk, bypassing
+   the buffer cache, if DIRECT is true. */
+void
+file_set_direct (struct file *file, bool direct) 
+{
+  ASSERT (file != NULL);
+  file->direct = direct;
+}
+
+/* Returns true if FILE bypasses the buffer cache. */
+bool
+file_is_direct (struct file *file) 
+{
+  ASSERT (file != NULL);
+  return file->direct;
+}
+
 /* Prevents write operations on FILE's underlying inode
    until file_allow_write() is called or FILE is closed. */
 void
@@ -151,6 +196,16 @@ file_length (struct file *file)
   return inode_length (file->inode);
 }
 
+/* Sets the size of FILE to LENGTH bytes, dropping the data past
+   it or reading as zeros up to it. The position is unchanged.
+   Returns false if writes to FILE are denied or it can't shrink. */
+bool
+file_truncate (struct file *file, off_t length) 
+{
+  ASSERT (file != NULL);
+  return inode_truncate (file->inode, length);
+}
+
 /* Sets the current position in FILE to NEW_POS bytes from the
    start of the file. */
 void
@@ -1,6 +1,7 @@
 #ifndef FILESYS_FILE_H
 #define FILESYS_FILE_H
 
+#include <stdbool.h>
 #include "filesys/off_t.h"
 
 struct inode;
@@ -16,6 +17,11 @@ off_t file_read (struct file *, void *, off_t);
 off_t file_read_at (struct file *, void *, off_t size, off_t start);
 off_t file_write (struct file *, const void *, off_t);
 off_t file_write_at (struct file *, const void *, off_t size, off_t start);
+off_t file_write_cached (struct file *, const void *, off_t);
+void file_sync (struct file *);
+bool file_truncate (struct file *, off_t);
+void file_set_direct (struct file *, bool);
+bool file_is_direct (struct file *);
 
 /* Preventing writes. */
 void file_deny_write (struct file *);
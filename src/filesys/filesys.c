@@ -6,6 +6,7 @@
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
 #include "filesys/directory.h"
+#include "filesys/journal.h"
 #ifdef FILESYS
 #include "threads/thread.h"
 #include "filesys/cache.h"
@@ -28,20 +29,29 @@ filesys_init (bool format)
 
   inode_init ();
   free_map_init ();
+  journal_init ();
 
 #ifdef FILESYS
   /* Initialize cache */
   cache_init ();
   /* Creating read ahead and write behind threads */
-  //thread_create ("read_aheader", PRI_DEFAULT, read_aheader_func, NULL);
-  //thread_create ("flusher", PRI_DEFAULT, flusher_func, NULL);
+  thread_create ("read_aheader", PRI_DEFAULT, read_aheader_func, NULL);
+  thread_create ("flusher", PRI_DEFAULT, flusher_func, NULL);
 #endif
 
   if (format) 
   {
     do_format ();
   }
+  /* Finish what a crash interrupted before reading anything */
+  journal_open ();
   free_map_open ();
+
+#ifdef FILESYS
+  /* Every path lookup and allocation goes through these */
+  cache_pin (FREE_MAP_SECTOR);
+  cache_pin (ROOT_DIR_SECTOR);
+#endif
 }
 
 /* Shuts down the file system module, writing any unwritten data
@@ -53,10 +63,10 @@ filesys_done (void)
 
 
 #ifdef FILESYS
+  journal_close ();
   cache_destroy ();
   
   //cache_write_behind ();
-  //q_destroy ();
 #endif
   //free_map_close ();
 }
@@ -101,9 +111,15 @@ filesys_create (const char *name, off_t initial_size, enum inode_type type)
     return false;
   }
 
-  /* Allocate one sector for inode and create inode */
+  /* Allocate one sector for inode and create inode, a directory in
+   * the emptiest block group, anything else next to its parent.
+   * All of it is one journal transaction. */
+  journal_begin (JOURNAL_CREATE, true);
   bool success = (dir != NULL
-                  && free_map_allocate (1, &inode_sector)
+                  && free_map_allocate_near (1, type == INODE_DIR
+                                             ? free_map_spread_goal ()
+                                             : inode_get_inumber (dir_get_inode (dir)),
+                                             &inode_sector)
                   && inode_create (inode_sector, initial_size, type)
                   && dir_add (dir, last_name, inode_sector));
   
@@ -113,6 +129,7 @@ filesys_create (const char *name, off_t initial_size, enum inode_type type)
   }
   
   dir_close (dir);
+  journal_end ();
   free (last_name);
   
   return success;
@@ -188,9 +205,11 @@ filesys_remove (const char *name)
     return false;
   }
 
+  journal_begin (JOURNAL_REMOVE, true);
   success = success && dir_remove (dir, last_name);
   
   dir_close (dir); 
+  journal_end ();
   free (last_name);
   return success;
 }
@@ -200,6 +219,7 @@ static void
 do_format (void)
 {
   printf ("Formatting file system...");
+  journal_create ();
   free_map_create ();
   if (!dir_create (ROOT_DIR_SECTOR, 7))
     PANIC ("root directory creation failed");
@@ -9,6 +9,10 @@
 #define FREE_MAP_SECTOR 0       /* Free map file inode sector. */
 #define ROOT_DIR_SECTOR 1       /* Root directory file inode sector. */
 
+/* Metadata journal, a run of sectors reserved when formatting. */
+#define JOURNAL_SECTOR 2        /* Journal header sector. */
+#define JOURNAL_SECTORS 64      /* Journal length, header included. */
+
 /* Block device that contains the file system. */
 struct block *fs_device;
 
@@ -1,12 +1,96 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Free map bits held by one sector of the free map file. */
+#define BITS_PER_SECTOR (BLOCK_SECTOR_SIZE * 8)
+
+/* Sectors per block group. Files are placed in the group of their
+   directory and data in the group of its inode. */
+#define GROUP_SECTORS 512
+
+/* Free runs looked at in a group before trying elsewhere. */
+#define GROUP_PROBES 16
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct bitmap *dirty;         /* Free map file sectors changed
+                                        since written, one bit each. */
+static struct bitmap *held;          /* Sectors released by the running
+                                        journal transaction, free on
+                                        disk but not handed out until
+                                        it commits. */
+static size_t held_cnt;              /* Sectors set in HELD. */
+static int batch_depth;              /* Writes are held back while > 0. */
+static size_t free_cnt;              /* Free sectors. */
+static size_t group_cnt;             /* Number of block groups. */
+static size_t *group_free;           /* Free sectors in each group. */
+
+/* Node of an AVL tree of free extents. */
+struct fx_node
+  {
+    struct fx_node *left, *right;
+    int height;                      /* Of the subtree, 1 for a leaf. */
+  };
+
+/* A maximal run of free sectors, in both trees. */
+struct free_extent
+  {
+    block_sector_t start;
+    block_sector_t length;
+    struct fx_node by_size;          /* In size_tree. */
+    struct fx_node by_addr;          /* In addr_tree. */
+  };
+
+/* Converts pointer to fx_node NODE into a pointer to the
+   free_extent it is the MEMBER of. */
+#define fx_entry(NODE, MEMBER) \
+        ((struct free_extent *) ((uint8_t *) (NODE) \
+                                 - offsetof (struct free_extent, MEMBER)))
+
+typedef bool fx_less_func (const struct fx_node *, const struct fx_node *);
+
+/* Index of the free runs in free_map. Holds every run while
+   index_ok, otherwise it's empty and allocation scans the bitmap,
+   which happens if a free_extent couldn't be allocated. */
+static struct fx_node *size_tree;    /* By length, then start. */
+static struct fx_node *addr_tree;    /* By start. */
+static bool index_ok;
+static struct lock free_map_lock;    /* Protects all of the above. */
+
+static void free_map_enter (void);
+static void free_map_leave (void);
+static void free_map_mark (block_sector_t, size_t);
+static bool free_map_write (void);
+static void free_map_take (block_sector_t, size_t);
+static void free_map_give (block_sector_t, size_t);
+static void free_map_add (block_sector_t, size_t);
+static size_t free_map_scan (size_t, size_t);
+static void free_map_index (void);
+static void free_map_count (block_sector_t, size_t, bool);
+static block_sector_t free_map_scan_group (size_t, block_sector_t);
+static void fx_add (block_sector_t, block_sector_t);
+static void fx_del (struct free_extent *);
+static void fx_clear (struct fx_node *);
+static struct free_extent *fx_best_fit (size_t);
+static struct free_extent *fx_floor (block_sector_t);
+static struct free_extent *fx_next (block_sector_t);
+static bool fx_size_less (const struct fx_node *, const struct fx_node *);
+static bool fx_addr_less (const struct fx_node *, const struct fx_node *);
+static struct fx_node *fx_insert (struct fx_node *, struct fx_node *,
+                                  fx_less_func *);
+static struct fx_node *fx_remove (struct fx_node *, struct fx_node *,
+                                  fx_less_func *);
 
 /* Initializes the free map. */
 void
@@ -15,38 +99,265 @@ free_map_init (void)
   free_map = bitmap_create (block_size (fs_device));
   if (free_map == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
+  dirty = bitmap_create (DIV_ROUND_UP (bitmap_size (free_map),
+                                       BITS_PER_SECTOR));
+  held = bitmap_create (bitmap_size (free_map));
+  if (dirty == NULL || held == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
+  group_cnt = DIV_ROUND_UP (bitmap_size (free_map), GROUP_SECTORS);
+  group_free = malloc (group_cnt * sizeof *group_free);
+  if (group_free == NULL)
+    PANIC ("block group allocation failed");
+  lock_init (&free_map_lock);
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  bitmap_set_multiple (free_map, JOURNAL_SECTOR, JOURNAL_SECTORS, true);
+  free_map_index ();
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
-   the first into *SECTORP.
+   the first into *SECTORP. The smallest free run that is long
+   enough is used, the lowest one of those.
    Returns true if successful, false if not enough consecutive
    sectors were available or if the free_map file could not be
    written. */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  block_sector_t sector;
+
+  free_map_enter ();
+  if (index_ok)
     {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
+      struct free_extent *e = fx_best_fit (cnt);
+      sector = e != NULL ? e->start : BITMAP_ERROR;
     }
+  else
+    sector = free_map_scan (0, cnt);
+  if (sector != BITMAP_ERROR)
+    {
+      free_map_take (sector, cnt);
+      if (!free_map_write ())
+        {
+          free_map_give (sector, cnt);
+          sector = BITMAP_ERROR;
+        }
+    }
+  free_map_leave ();
   if (sector != BITMAP_ERROR)
     *sectorp = sector;
   return sector != BITMAP_ERROR;
 }
 
-/* Makes CNT sectors starting at SECTOR available for use. */
+/* Like free_map_allocate(), but first looks for CNT free sectors in
+   the block group of GOAL, at GOAL itself or else the first run
+   after it that is long enough, so that related sectors stay close.
+   Falls back to free_map_allocate() if the group has no room. */
+bool
+free_map_allocate_near (size_t cnt, block_sector_t goal,
+                        block_sector_t *sectorp)
+{
+  block_sector_t sector = BITMAP_ERROR;
+
+  free_map_enter ();
+  if (goal < bitmap_size (free_map))
+    sector = free_map_scan_group (cnt, goal);
+  if (sector != BITMAP_ERROR)
+    {
+      free_map_take (sector, cnt);
+      if (!free_map_write ())
+        {
+          free_map_give (sector, cnt);
+          sector = BITMAP_ERROR;
+        }
+    }
+  free_map_leave ();
+  if (sector != BITMAP_ERROR)
+    {
+      *sectorp = sector;
+      return true;
+    }
+  return free_map_allocate (cnt, sectorp);
+}
+
+/* Returns where to put a new directory's inode, at the start of the
+   block group with the most free sectors, so that directories and
+   the files in them spread over the disk. */
+block_sector_t
+free_map_spread_goal (void)
+{
+  size_t best = 0;
+  size_t i;
+
+  lock_acquire (&free_map_lock);
+  for (i = 1; i < group_cnt; i++)
+    if (group_free[i] > group_free[best])
+      best = i;
+  lock_release (&free_map_lock);
+  return best * GROUP_SECTORS;
+}
+
+/* Allocates the CNT sectors starting at SECTOR if all of them
+   are free. Returns true if successful, false if any of them is
+   in use, past the end of the disk, or the free map file could
+   not be written. */
+bool
+free_map_allocate_at (block_sector_t sector, size_t cnt)
+{
+  bool success = false;
+  bool free;
+
+  free_map_enter ();
+  if (sector + cnt > bitmap_size (free_map))
+    free = false;
+  else if (index_ok)
+    {
+      struct free_extent *e = fx_floor (sector);
+      free = e != NULL && sector + cnt <= e->start + e->length;
+    }
+  else
+    free = (!bitmap_contains (free_map, sector, cnt, true)
+            && !bitmap_contains (held, sector, cnt, true));
+  if (free)
+    {
+      free_map_take (sector, cnt);
+      success = free_map_write ();
+      if (!success)
+        free_map_give (sector, cnt);
+    }
+  free_map_leave ();
+  return success;
+}
+
+/* Makes CNT sectors starting at SECTOR available for use. The
+   journal is told so that it doesn't bring back what they held.
+   Until the transaction doing that commits, a crash would bring
+   back whatever pointed to them, so they are only marked free on
+   disk and held back from allocation until free_map_reclaim(). */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  /* Revoke and release go in the same transaction */
+  journal_begin (0, true);
+  journal_revoke (sector, cnt);
+  free_map_enter ();
   ASSERT (bitmap_all (free_map, sector, cnt));
-  bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  if (journal_active ())
+    {
+      bitmap_set_multiple (free_map, sector, cnt, false);
+      free_map_mark (sector, cnt);
+      bitmap_set_multiple (held, sector, cnt, true);
+      held_cnt += cnt;
+    }
+  else
+    free_map_give (sector, cnt);
+  free_map_write ();
+  free_map_leave ();
+  journal_end ();
+}
+
+/* Makes the sectors held back by free_map_release() available,
+   once the journal has committed their release. */
+void
+free_map_reclaim (void)
+{
+  size_t start = 0;
+
+  lock_acquire (&free_map_lock);
+  while (held_cnt > 0
+         && (start = bitmap_scan (held, start, 1, true)) != BITMAP_ERROR)
+    {
+      size_t end = bitmap_scan (held, start, 1, false);
+
+      if (end == BITMAP_ERROR)
+        end = bitmap_size (held);
+      bitmap_set_multiple (held, start, end - start, false);
+      held_cnt -= end - start;
+      free_map_add (start, end - start);
+      start = end;
+    }
+  lock_release (&free_map_lock);
+}
+
+/* Holds back writing the free map to disk until the matching
+   free_map_batch_end(), so that releasing many runs writes each
+   changed sector of it once. Batches may nest. */
+void
+free_map_batch_begin (void)
+{
+  lock_acquire (&free_map_lock);
+  batch_depth++;
+  lock_release (&free_map_lock);
+}
+
+/* Ends a batch begun with free_map_batch_begin(), writing what
+   changed if this was the outermost batch. */
+void
+free_map_batch_end (void)
+{
+  free_map_enter ();
+  ASSERT (batch_depth > 0);
+  batch_depth--;
+  free_map_write ();
+  free_map_leave ();
+}
+
+/* Takes free_map_lock to change the free map. Writing the free map
+   file may log its sectors, so a journal handle is opened first,
+   which mustn't wait for a commit with the lock held. */
+static void
+free_map_enter (void)
+{
+  journal_begin (0, true);
+  lock_acquire (&free_map_lock);
+}
+
+/* Releases what free_map_enter() took. */
+static void
+free_map_leave (void)
+{
+  lock_release (&free_map_lock);
+  journal_end ();
+}
+
+/* Notes that the free map file sectors holding the bits of the CNT
+   sectors starting at SECTOR need writing. */
+static void
+free_map_mark (block_sector_t sector, size_t cnt)
+{
+  size_t first = sector / BITS_PER_SECTOR;
+  size_t last = (sector + cnt - 1) / BITS_PER_SECTOR;
+
+  if (cnt > 0)
+    bitmap_set_multiple (dirty, first, last - first + 1, true);
+}
+
+/* Writes the changed sectors of the free map to its file, unless it
+   isn't open yet or a batch is in progress. Returns false if a
+   write failed, those sectors stay marked. free_map_lock must be
+   held. */
+static bool
+free_map_write (void)
+{
+  bool success = true;
+  size_t i;
+
+  if (free_map_file == NULL || batch_depth > 0)
+    return true;
+  for (i = bitmap_scan (dirty, 0, 1, true); i != BITMAP_ERROR;
+       i = bitmap_scan (dirty, i + 1, 1, true))
+    {
+      size_t start = i * BITS_PER_SECTOR;
+      size_t cnt = bitmap_size (free_map) - start;
+
+      if (cnt > BITS_PER_SECTOR)
+        cnt = BITS_PER_SECTOR;
+      if (bitmap_write_range (free_map, free_map_file, start, cnt))
+        bitmap_reset (dirty, i);
+      else
+        success = false;
+    }
+  return success;
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -58,13 +369,23 @@ free_map_open (void)
     PANIC ("can't open free map");
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  lock_acquire (&free_map_lock);
+  free_map_index ();
+  lock_release (&free_map_lock);
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
 free_map_close (void) 
 {
-  file_close (free_map_file);
+  struct file *file;
+
+  free_map_enter ();
+  free_map_write ();
+  file = free_map_file;
+  free_map_file = NULL;
+  free_map_leave ();
+  file_close (file);
 }
 
 /* Creates a new free map file on disk and writes the free map to
@@ -72,24 +393,445 @@ free_map_close (void)
 void
 free_map_create (void) 
 {
+  struct inode *inode;
+
   /* Create inode. */
   if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map), INODE_FILE))
     PANIC ("free map creation failed");
   
-  /* Write bitmap to file. */
-  free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
+  /* Write bitmap to file. Its sectors are allocated up front,
+     since writing it must never allocate. */
+  inode = inode_open (FREE_MAP_SECTOR);
+  if (inode == NULL
+      || !inode_allocate (inode, 0, bitmap_file_size (free_map)))
+    PANIC ("free map allocation failed");
+  free_map_file = file_open (inode);
   if (free_map_file == NULL)
     PANIC ("can't open free map");
   if (!bitmap_write (free_map, free_map_file))
     PANIC ("can't write free map");
+  bitmap_set_all (dirty, false);
 }
 
 /* Returns number of free sector */
 size_t
 free_map_left (void)
 {
-  size_t size = bitmap_size (free_map); 
-  size_t cnt = bitmap_count (free_map, (size_t) 0, size, false); 
-  return cnt;
+  return free_cnt;
+}
+
+/* Returns the first of CNT free sectors in the block group of GOAL,
+   at GOAL if it is free, else at the start of one of the next few
+   free runs in the group. BITMAP_ERROR if there is none. */
+static block_sector_t
+free_map_scan_group (size_t cnt, block_sector_t goal)
+{
+  block_sector_t end = ROUND_DOWN (goal, GROUP_SECTORS) + GROUP_SECTORS;
+  struct free_extent *e;
+  size_t sector;
+  int i;
+
+  if (!index_ok)
+    {
+      sector = free_map_scan (goal, cnt);
+      return sector < end ? sector : BITMAP_ERROR;
+    }
+  e = fx_floor (goal);
+  if (e != NULL && goal + cnt <= e->start + e->length)
+    return goal;
+  for (i = 0, e = fx_next (goal); i < GROUP_PROBES && e != NULL
+       && e->start < end; i++, e = fx_next (e->start))
+    if (e->length >= cnt)
+      return e->start;
+  return BITMAP_ERROR;
+}
+
+/* Adds CNT sectors starting at SECTOR to the free counts if FREED,
+   subtracts them otherwise. */
+static void
+free_map_count (block_sector_t sector, size_t cnt, bool freed)
+{
+  while (cnt > 0)
+    {
+      size_t group = sector / GROUP_SECTORS;
+      size_t n = (group + 1) * GROUP_SECTORS - sector;
+
+      if (n > cnt)
+        n = cnt;
+      if (freed)
+        group_free[group] += n;
+      else
+        group_free[group] -= n;
+      sector += n;
+      cnt -= n;
+    }
+}
+
+/* Marks the CNT free sectors starting at SECTOR as used, in the
+   bitmap and the index. */
+static void
+free_map_take (block_sector_t sector, size_t cnt)
+{
+  bitmap_set_multiple (free_map, sector, cnt, true);
+  free_map_mark (sector, cnt);
+  free_cnt -= cnt;
+  free_map_count (sector, cnt, false);
+  if (index_ok)
+    {
+      struct free_extent *e = fx_floor (sector);
+      block_sector_t start = e->start;
+      block_sector_t end = e->start + e->length;
+
+      ASSERT (sector + cnt <= end);
+      fx_del (e);
+      if (start < sector)
+        fx_add (start, sector - start);
+      if (sector + cnt < end)
+        fx_add (sector + cnt, end - (sector + cnt));
+    }
+}
+
+/* Marks the CNT used sectors starting at SECTOR as free, in the
+   bitmap and the index. */
+static void
+free_map_give (block_sector_t sector, size_t cnt)
+{
+  bitmap_set_multiple (free_map, sector, cnt, false);
+  free_map_mark (sector, cnt);
+  free_map_add (sector, cnt);
+}
+
+/* Adds the CNT sectors starting at SECTOR, free in the bitmap, to
+   the free counts and the index, merging with the free runs on
+   each side. */
+static void
+free_map_add (block_sector_t sector, size_t cnt)
+{
+  free_cnt += cnt;
+  free_map_count (sector, cnt, true);
+  if (index_ok)
+    {
+      struct free_extent *prev = fx_floor (sector);
+      struct free_extent *next = fx_floor (sector + cnt);
+      block_sector_t start = sector;
+      block_sector_t end = sector + cnt;
+
+      if (prev != NULL && prev->start + prev->length != start)
+        prev = NULL;
+      if (next != NULL && next->start != end)
+        next = NULL;
+      if (prev != NULL)
+        {
+          start = prev->start;
+          fx_del (prev);
+        }
+      if (next != NULL)
+        {
+          end += next->length;
+          fx_del (next);
+        }
+      fx_add (start, end - start);
+    }
+}
+
+/* Returns the first of CNT consecutive sectors from START on that
+   are free and not held back, BITMAP_ERROR if there are none. For
+   when there is no index. */
+static size_t
+free_map_scan (size_t start, size_t cnt)
+{
+  size_t sector;
+
+  while ((sector = bitmap_scan (free_map, start, cnt, false)) != BITMAP_ERROR
+         && held_cnt > 0 && bitmap_contains (held, sector, cnt, true))
+    start = sector + 1;
+  return sector;
+}
+
+/* Rebuilds the index and the free counts from the bitmap, leaving
+   out sectors held back. */
+static void
+free_map_index (void)
+{
+  size_t size = bitmap_size (free_map);
+  size_t start = 0;
+
+  fx_clear (addr_tree);
+  size_tree = addr_tree = NULL;
+  index_ok = true;
+  free_cnt = 0;
+  memset (group_free, 0, group_cnt * sizeof *group_free);
+  while ((start = free_map_scan (start, 1)) != BITMAP_ERROR)
+    {
+      size_t end = bitmap_scan (free_map, start, 1, true);
+      size_t held_start = bitmap_scan (held, start, 1, true);
+
+      if (end == BITMAP_ERROR)
+        end = size;
+      if (held_start < end)
+        end = held_start;
+      fx_add (start, end - start);
+      free_cnt += end - start;
+      free_map_count (start, end - start, true);
+      start = end;
+    }
+}
+
+/* Adds the free run of LENGTH sectors at START to the index. If
+   there is no memory for it, gives up on the index. */
+static void
+fx_add (block_sector_t start, block_sector_t length)
+{
+  struct free_extent *e;
+
+  if (!index_ok)
+    return;
+  e = malloc (sizeof *e);
+  if (e == NULL)
+    {
+      fx_clear (addr_tree);
+      size_tree = addr_tree = NULL;
+      index_ok = false;
+      return;
+    }
+  e->start = start;
+  e->length = length;
+  size_tree = fx_insert (size_tree, &e->by_size, fx_size_less);
+  addr_tree = fx_insert (addr_tree, &e->by_addr, fx_addr_less);
+}
+
+/* Removes E from the index and frees it. */
+static void
+fx_del (struct free_extent *e)
+{
+  size_tree = fx_remove (size_tree, &e->by_size, fx_size_less);
+  addr_tree = fx_remove (addr_tree, &e->by_addr, fx_addr_less);
+  free (e);
+}
+
+/* Frees the extents in the address tree NODE. */
+static void
+fx_clear (struct fx_node *node)
+{
+  if (node != NULL)
+    {
+      fx_clear (node->left);
+      fx_clear (node->right);
+      free (fx_entry (node, by_addr));
+    }
+}
+
+/* Returns the shortest free run of at least CNT sectors, the
+   lowest one of those, or a null pointer if there is none. */
+static struct free_extent *
+fx_best_fit (size_t cnt)
+{
+  struct fx_node *node = size_tree;
+  struct free_extent *best = NULL;
+
+  while (node != NULL)
+    {
+      struct free_extent *e = fx_entry (node, by_size);
+
+      if (e->length >= cnt)
+        {
+          best = e;
+          node = node->left;
+        }
+      else
+        node = node->right;
+    }
+  return best;
 }
 
+/* Returns the free run that starts last at or before SECTOR, or a
+   null pointer if there is none. */
+static struct free_extent *
+fx_floor (block_sector_t sector)
+{
+  struct fx_node *node = addr_tree;
+  struct free_extent *floor = NULL;
+
+  while (node != NULL)
+    {
+      struct free_extent *e = fx_entry (node, by_addr);
+
+      if (e->start <= sector)
+        {
+          floor = e;
+          node = node->right;
+        }
+      else
+        node = node->left;
+    }
+  return floor;
+}
+
+/* Returns the free run that starts first after SECTOR, or a null
+   pointer if there is none. */
+static struct free_extent *
+fx_next (block_sector_t sector)
+{
+  struct fx_node *node = addr_tree;
+  struct free_extent *next = NULL;
+
+  while (node != NULL)
+    {
+      struct free_extent *e = fx_entry (node, by_addr);
+
+      if (e->start > sector)
+        {
+          next = e;
+          node = node->left;
+        }
+      else
+        node = node->right;
+    }
+  return next;
+}
+
+/* Orders size_tree by length, then start. */
+static bool
+fx_size_less (const struct fx_node *a_, const struct fx_node *b_)
+{
+  const struct free_extent *a = fx_entry (a_, by_size);
+  const struct free_extent *b = fx_entry (b_, by_size);
+
+  if (a->length != b->length)
+    return a->length < b->length;
+  return a->start < b->start;
+}
+
+/* Orders addr_tree by start. */
+static bool
+fx_addr_less (const struct fx_node *a_, const struct fx_node *b_)
+{
+  const struct free_extent *a = fx_entry (a_, by_addr);
+  const struct free_extent *b = fx_entry (b_, by_addr);
+
+  return a->start < b->start;
+}
+
+/* Height of the subtree NODE. */
+static int
+fx_height (const struct fx_node *node)
+{
+  return node != NULL ? node->height : 0;
+}
+
+/* Recomputes the height of NODE from its children. */
+static void
+fx_fix (struct fx_node *node)
+{
+  int l = fx_height (node->left);
+  int r = fx_height (node->right);
+
+  node->height = (l > r ? l : r) + 1;
+}
+
+/* Rotates the subtree NODE to the right and returns its new root. */
+static struct fx_node *
+fx_rotate_right (struct fx_node *node)
+{
+  struct fx_node *l = node->left;
+
+  node->left = l->right;
+  l->right = node;
+  fx_fix (node);
+  fx_fix (l);
+  return l;
+}
+
+/* Rotates the subtree NODE to the left and returns its new root. */
+static struct fx_node *
+fx_rotate_left (struct fx_node *node)
+{
+  struct fx_node *r = node->right;
+
+  node->right = r->left;
+  r->left = node;
+  fx_fix (node);
+  fx_fix (r);
+  return r;
+}
+
+/* Restores the AVL balance of NODE, whose children differ in
+   height by at most 2, and returns the subtree's new root. */
+static struct fx_node *
+fx_balance (struct fx_node *node)
+{
+  int bf;
+
+  fx_fix (node);
+  bf = fx_height (node->left) - fx_height (node->right);
+  if (bf > 1)
+    {
+      if (fx_height (node->left->left) < fx_height (node->left->right))
+        node->left = fx_rotate_left (node->left);
+      return fx_rotate_right (node);
+    }
+  if (bf < -1)
+    {
+      if (fx_height (node->right->right) < fx_height (node->right->left))
+        node->right = fx_rotate_right (node->right);
+      return fx_rotate_left (node);
+    }
+  return node;
+}
+
+/* Inserts NODE into the tree ROOT ordered by LESS and returns the
+   new root. */
+static struct fx_node *
+fx_insert (struct fx_node *root, struct fx_node *node, fx_less_func *less)
+{
+  if (root == NULL)
+    {
+      node->left = node->right = NULL;
+      node->height = 1;
+      return node;
+    }
+  if (less (node, root))
+    root->left = fx_insert (root->left, node, less);
+  else
+    root->right = fx_insert (root->right, node, less);
+  return fx_balance (root);
+}
+
+/* Removes the leftmost node of the tree ROOT into *MIN and returns
+   the new root. */
+static struct fx_node *
+fx_remove_min (struct fx_node *root, struct fx_node **min)
+{
+  if (root->left == NULL)
+    {
+      *min = root;
+      return root->right;
+    }
+  root->left = fx_remove_min (root->left, min);
+  return fx_balance (root);
+}
+
+/* Removes NODE from the tree ROOT ordered by LESS and returns the
+   new root. */
+static struct fx_node *
+fx_remove (struct fx_node *root, struct fx_node *node, fx_less_func *less)
+{
+  ASSERT (root != NULL);
+
+  if (root == node)
+    {
+      struct fx_node *min;
+
+      if (node->right == NULL)
+        return node->left;
+      node->right = fx_remove_min (node->right, &min);
+      min->left = node->left;
+      min->right = node->right;
+      return fx_balance (min);
+    }
+  if (less (node, root))
+    root->left = fx_remove (root->left, node, less);
+  else
+    root->right = fx_remove (root->right, node, less);
+  return fx_balance (root);
+}
@@ -11,7 +11,14 @@ void free_map_create (void);
 void free_map_open (void);
 void free_map_close (void);
 bool free_map_allocate (size_t, block_sector_t *);
+bool free_map_allocate_near (size_t, block_sector_t goal,
+                             block_sector_t *);
+block_sector_t free_map_spread_goal (void);
+bool free_map_allocate_at (block_sector_t, size_t);
 void free_map_release (block_sector_t, size_t);
+void free_map_reclaim (void);
+void free_map_batch_begin (void);
+void free_map_batch_end (void);
 size_t free_map_left (void);
 
 #endif /* filesys/free-map.h */
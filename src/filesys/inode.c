@@ -1,17 +1,17 @@
 #include "filesys/inode.h"
 #include <list.h>
+#include <hash.h>
 #include <debug.h>
 #include <round.h>
+#include <stddef.h>
 #include <string.h>
 #include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
 #include "threads/thread.h"
 
-/* Identifies an inode. */
-#define INODE_MAGIC 0x494e4f44
-
 /* Returns the number of sectors to allocate for an inode SIZE
    bytes long. */
 static inline size_t
@@ -20,15 +20,114 @@ bytes_to_sectors (off_t size)
   return DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE);
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+static void inode_read_ahead (struct inode *, off_t);
+static bool inode_create_extents (block_sector_t, off_t, enum inode_type);
+static void inode_map_refresh (struct inode *);
+static bool inode_read_inline (struct inode *, void *, off_t, off_t,
+                               off_t *);
+static bool inode_write_inline (struct inode *, const void *, off_t, off_t,
+                                off_t *);
+static void inode_io_begin (struct inode *);
+static void inode_io_end (struct inode *);
+
+/* Returns the block device sector that contains byte offset POS
+   within INODE, and in *CNT how many sectors from there on are
+   consecutive on disk. Returns EXTENT_HOLE if POS lies in a hole,
+   and -1 if INODE does not contain data for a byte at offset POS.
+   If the block map is being changed, waits for that to finish. */
+static block_sector_t
+byte_to_run (struct inode *inode, off_t pos, block_sector_t *cnt)
+{
+  block_sector_t sector;
+
+  for (;;)
+    {
+      unsigned seq = inode->map_seq;
+
+      barrier ();
+      if (seq % 2 == 0)
+        {
+          if (!cache_map_try_lookup (inode->map, pos, &sector, cnt))
+            break;
+          barrier ();
+          if (inode->map_seq == seq)
+            return sector;
+        }
+      lock_acquire (&inode->extension_lock);
+      lock_release (&inode->extension_lock);
+    }
+
+  /* The lookup follows index or extent blocks, which a truncate
+     may be freeing and reusing meanwhile, so hold it off. */
+  lock_acquire (&inode->extension_lock);
+  sector = cache_map_lookup (inode->map, pos, cnt);
+  lock_release (&inode->extension_lock);
+  return sector;
+}
+
+/* Returns the block device sector that contains byte offset POS
+   within INODE, EXTENT_HOLE in a hole, -1 if there is none. */
+static block_sector_t
+byte_to_sector (struct inode *inode, off_t pos)
+{
+  block_sector_t cnt;
+
+  return byte_to_run (inode, pos, &cnt);
+}
+static block_sector_t inode_direct_run (struct inode *, off_t, off_t,
+                                        block_sector_t *);
+
+/* Open inodes keyed by sector, so that opening a single inode
+   twice returns the same `struct inode'. */
+static struct hash open_inodes;
+
+/* Protects open_inodes and every inode's open_cnt. */
+static struct lock open_inodes_lock;
+
+static unsigned inode_hash (const struct hash_elem *, void *);
+static bool inode_less (const struct hash_elem *, const struct hash_elem *,
+                        void *);
+static struct inode *inode_find (block_sector_t);
 
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
-  list_init (&open_inodes);
+  hash_init (&open_inodes, inode_hash, inode_less, NULL);
+  lock_init (&open_inodes_lock);
+}
+
+/* Hash function for open_inodes, keyed by sector number */
+static unsigned
+inode_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct inode *inode = hash_entry (e, struct inode, elem);
+  return hash_int (inode->sector);
+}
+
+/* Compare function for open_inodes */
+static bool
+inode_less (const struct hash_elem *a_, const struct hash_elem *b_,
+            void *aux UNUSED)
+{
+  const struct inode *a = hash_entry (a_, struct inode, elem);
+  const struct inode *b = hash_entry (b_, struct inode, elem);
+
+  return a->sector < b->sector;
+}
+
+/* Returns the open inode at SECTOR, or NULL if there is none.
+   open_inodes_lock must be held. */
+static struct inode *
+inode_find (block_sector_t sector)
+{
+  struct inode key;
+  struct hash_elem *e;
+
+  ASSERT (lock_held_by_current_thread (&open_inodes_lock));
+  key.sector = sector;
+  e = hash_find (&open_inodes, &key.elem);
+  return e != NULL ? hash_entry (e, struct inode, elem) : NULL;
 }
 
 /* Initializes an inode with LENGTH bytes of data and
@@ -39,129 +138,67 @@ inode_init (void)
 bool
 inode_create (block_sector_t sector, off_t length, enum inode_type type)
 {
-  //printf ("[inode_create] sector %d, length %d, type %d\n", sector, length, type);
   struct inode_disk *inode_id = NULL;
-  struct index_disk *index_id = NULL;
-  bool success = false;
   
   ASSERT (length >= 0);
 
   /* If this assertion fails, the inode structure is not exactly
      one sector in size, and you should fix that. */
   ASSERT (sizeof *inode_id == BLOCK_SECTOR_SIZE);
-  ASSERT (sizeof *index_id == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof (struct index_disk) == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof (struct extent_disk) == BLOCK_SECTOR_SIZE);
+
+  /* Regular files map their data with extents */
+  if (type == INODE_FILE)
+  {
+    return inode_create_extents (sector, length, type);
+  }
   
   inode_id = calloc (1, sizeof *inode_id);
-  if (inode_id != NULL)
+  if (inode_id == NULL)
+  {
+    return false;
+  }
+  /* Start out empty, then grow to LENGTH, which takes every sector
+     needed or none */
+  inode_id->length = 0;
+  inode_id->magic = INODE_MAGIC;
+  inode_id->type = type;
+  cache_write_at (sector, inode_id, BLOCK_SECTOR_SIZE, 0, sector);
+  free (inode_id);
+  return cache_inode_extend (sector, length);
+}
+
+/* Initializes an extent inode with LENGTH bytes of data and
+   writes the new inode to sector SECTOR on the file system
+   device. The data starts out as a hole, sectors are allocated
+   as they are written. Files of up to INODE_INLINE_MAX bytes keep
+   their data in the inode instead, until they grow past that.
+   Returns true if successful. */
+static bool
+inode_create_extents (block_sector_t sector, off_t length,
+                      enum inode_type type)
+{
+  struct inode_disk *inode_id = calloc (1, sizeof *inode_id);
+
+  if (inode_id == NULL)
+  {
+    return false;
+  }
+  inode_id->type = type;
+  if (length <= INODE_INLINE_MAX)
   {
-    size_t sectors = bytes_to_sectors (length);
     inode_id->length = length;
-    inode_id->magic = INODE_MAGIC;
-    inode_id->type = type;
-    /* Calculate number of needed sector for inode */
-    size_t sector_needed = sectors;
-    if (sectors > DIRECT_BLOCK) 
-    {
-      sector_needed++;
-    }
-    if (sectors > DIRECT_BLOCK + INDEX_BLOCK)
-    {
-      sector_needed += DIV_ROUND_UP(sectors - DIRECT_BLOCK - INDEX_BLOCK, INDEX_BLOCK);
-    }
-    
-    /* Available space in file disk or not */
-    if (free_map_left () >= sector_needed)
-    {
-      /* zeros */
-      static char zeros[BLOCK_SECTOR_SIZE];
-      /* sector remained for data part of this inode */
-      size_t sector_remained = sectors;
-      /* Number of block in direct indexing */
-      size_t direct_cnt = DIRECT_BLOCK > sector_remained? sector_remained : DIRECT_BLOCK;
-      
-      /* Allocate for direct block */
-      size_t i;
-      for (i = 0; i < direct_cnt; i++)
-      {
-        free_map_allocate (1, &inode_id->direct[i]);
-        
-        cache_write_at (inode_id->direct[i], zeros, BLOCK_SECTOR_SIZE, 0);
-        sector_remained--;
-      }
-      /* Indirect block needed? */
-      if (sector_remained > 0)
-      {
-        /* Allocate index_disk for single indirect index sector */
-        struct index_disk *si_id = calloc (1, sizeof *index_id);
-        if (si_id != NULL)
-        {
-          /* Write indirect index */
-          free_map_allocate (1, &inode_id->indirect[0]);
-          /* Number of block in indirect indexing */
-          size_t indirect_cnt = INDEX_BLOCK > sector_remained? sector_remained : INDEX_BLOCK;
-          /* Allocate for indirect block */
-          size_t i;
-          for (i = 0; i < indirect_cnt; i++)
-          {
-            free_map_allocate (1, &si_id->index[i]);
-            cache_write_at (si_id->index[i], zeros, BLOCK_SECTOR_SIZE, 0);
-            sector_remained--;
-          }
-          /* Write single indirect index block in inode_id->indirect[0] */
-          cache_write_at (inode_id->indirect[0], si_id, BLOCK_SECTOR_SIZE, 0);
-          free (si_id);
-
-          /* Doubly indirect block needed? */
-          if (sector_remained > 0)
-          {
-            /* Allocate index_disk for doubly indirect index block */
-            struct index_disk *di_id = calloc (1, sizeof *index_id);
-            
-            if (di_id != NULL)
-            {
-              /* Allocate  doubly indirect index */
-              free_map_allocate (1, &inode_id->doubly_indirect[0]);
-              /* Index of doubly indirect index */
-              size_t k = 0;
-              
-              while (sector_remained > 0)
-              {
-                struct index_disk *dii_id = calloc (1, sizeof *index_id);
-                if (dii_id != NULL)        
-                {
-                  free_map_allocate (1, &di_id->index[k]);
-                  /* Number of block in current doubly indirect indirect index */ 
-                  size_t doubly_indirect_cnt = INDEX_BLOCK > sector_remained? 
-                    sector_remained : INDEX_BLOCK;
-                  
-                  /* Allocate for doubly indirect block */
-                  size_t i;
-                  for (i = 0; i < doubly_indirect_cnt; i++)
-                  {
-                    free_map_allocate (1, &dii_id->index[i]);
-                    cache_write_at (dii_id->index[i], zeros, BLOCK_SECTOR_SIZE, 0);
-                    sector_remained--;
-                  }
-                  /* Write doubly indirect indirect index block */
-                  cache_write_at (di_id->index[k], dii_id, BLOCK_SECTOR_SIZE, 0);
-                  free (dii_id);
-                  k++;
-                }
-              }
-              /* Write doubly indirect index block */
-              cache_write_at (inode_id->doubly_indirect[0], di_id, BLOCK_SECTOR_SIZE, 0);
-              free (di_id);
-            }
-          }
-        }
-      }
-      cache_write_at (sector, inode_id, BLOCK_SECTOR_SIZE, 0);
-      free (inode_id);
-      success = true;
-    }
+    inode_id->magic = INLINE_MAGIC;
+    cache_write_at (sector, inode_id, BLOCK_SECTOR_SIZE, 0, sector);
+    free (inode_id);
+    return true;
   }
-  /* Return inode creat success or not */
-  return success;
+  inode_id->length = 0;
+  inode_id->magic = EXTENT_MAGIC;
+  cache_write_at (sector, inode_id, BLOCK_SECTOR_SIZE, 0, sector);
+  free (inode_id);
+  return cache_inode_extend (sector, length);
 }
 
 /* Reads an inode from SECTOR
@@ -170,41 +207,71 @@ inode_create (block_sector_t sector, off_t length, enum inode_type type)
 struct inode *
 inode_open (block_sector_t sector)
 {
-  //printf ("[inode_open] sector : %d\n", sector);
-  struct list_elem *e;
   struct inode *inode;
+  struct inode *other;
 
   /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e)) 
+  lock_acquire (&open_inodes_lock);
+  inode = inode_find (sector);
+  if (inode != NULL)
     {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector) 
-        {
-          inode_reopen (inode);
-          return inode; 
-        }
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+      return inode;
     }
-  /* No opened inode for given sector, should open it */ 
+  lock_release (&open_inodes_lock);
+
+  /* No opened inode for given sector, should open it.
+     Read it without holding the lock, so other opens don't wait
+     on the disk. */
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL)
     return NULL;
+  inode->map = malloc (sizeof *inode->map);
+  if (inode->map == NULL)
+    {
+      free (inode);
+      return NULL;
+    }
+  cache_read_at (inode->map, sector, BLOCK_SECTOR_SIZE, 0);
 
   /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
-  
-  inode->type = cache_get_type (sector);;
+  inode->type = inode->map->type;
+  inode->length = inode->map->length;
   inode->sector = sector;
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->removed = false;
+  inode->next_read = 0;
+  inode->ahead_end = 0;
+  inode->prealloc.length = 0;
+  inode->map_seq = 0;
+  inode->io_cnt = 0;
+  inode->truncating = false;
   if (inode->type == INODE_DIR)
   {
     inode->pos = 0;
   }
   lock_init (&inode->extension_lock);
-  
+  lock_init (&inode->io_lock);
+  cond_init (&inode->io_idle);
+
+  /* Someone else may have opened it meanwhile, use theirs. */
+  lock_acquire (&open_inodes_lock);
+  other = inode_find (sector);
+  if (other != NULL)
+    other->open_cnt++;
+  else
+    hash_insert (&open_inodes, &inode->elem);
+  lock_release (&open_inodes_lock);
+
+  if (other != NULL)
+    {
+      free (inode->map);
+      free (inode);
+      return other;
+    }
   return inode;
 }
 
@@ -213,7 +280,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&open_inodes_lock);
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+    }
   return inode;
 }
 
@@ -224,25 +295,33 @@ inode_get_inumber (const struct inode *inode)
   return inode->sector;
 }
 
-/* Closes INODE and writes it to disk.
+/* Closes INODE. Its changes reach the disk later through the
+   flusher, or inode_sync() for those who need them there now.
    If this was the last reference to INODE, frees its memory.
    If INODE was also a removed inode, frees its blocks. */
 void
 inode_close (struct inode *inode) 
 {
-  //printf ("[inode_close] sector: %d\n", inode->sector);
+  bool last;
+
   /* Ignore null pointer. */
   if (inode == NULL)
     return;
   
-  /* Save inode's block to disk */
-  cache_write_behind ();
-  
   /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  lock_acquire (&open_inodes_lock);
+  last = --inode->open_cnt == 0;
+  if (last)
+    hash_delete (&open_inodes, &inode->elem);
+  lock_release (&open_inodes_lock);
+
+  if (last)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
+      journal_begin (0, true);
+
+      /* Give back the sectors reserved for growth */
+      if (inode->prealloc.length > 0)
+        free_map_release (inode->prealloc.start, inode->prealloc.length);
  
       /* Deallocate blocks if removed. */
       if (inode->removed) 
@@ -250,16 +329,27 @@ inode_close (struct inode *inode)
           /* Deallocate blocks in inode here */
           cache_close_inode (inode->sector);
         }
+      journal_end ();
+      free (inode->map);
       free (inode); 
     }
 }
 
+/* Makes INODE durable: its data is written to disk, and the
+   metadata changes of everyone are committed to the journal, from
+   where they go home later. */
+void
+inode_sync (struct inode *inode)
+{
+  cache_flush_inode (inode->sector);
+  journal_commit ();
+}
+
 /* Marks INODE to be deleted when it is closed by the last caller who
    has it open. */
 void
 inode_remove (struct inode *inode) 
 {
-  //printf ("[inode_remove] sector: %d\n", inode->sector);
   ASSERT (inode != NULL);
   inode->removed = true;
 }
@@ -270,25 +360,20 @@ inode_remove (struct inode *inode)
 off_t
 inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset) 
 {
-  //printf ("THREAD%d, [inode_read_at] sector: %d, size: %d, offset: %d\n", thread_current ()->tid,  inode->sector, size, offset);
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
+  bool sequential = offset == inode->next_read;
+
+  if (inode_read_inline (inode, buffer, size, offset, &bytes_read))
+    return bytes_read;
 
   while (size > 0) 
     {
+      inode_io_begin (inode);
       /* Disk sector to read, starting byte offset within sector. */
-      off_t sector_idx = cache_byte_to_sector (inode->sector, offset);
-      /* Abnormal offset */
-      if (sector_idx == -1)
-      {
-        break;
-      }
+      off_t sector_idx = byte_to_sector (inode, offset);
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
       
-      /* Used for read ahead */
-      bool read_ahead_needed = false;
-      block_sector_t next_sector_idx = 0;
-      
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
       off_t inode_left = inode_length (inode) - offset;
       int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
@@ -296,20 +381,67 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       
       /* Number of bytes to actually copy out of this sector. */
       int chunk_size = size < min_left ? size : min_left;
-      if (chunk_size <= 0)
-        break;
-      
-      cache_read_at (buffer + bytes_read, sector_idx, chunk_size, sector_ofs,
-            next_sector_idx, read_ahead_needed);
+
+      /* Abnormal offset */
+      if (sector_idx == -1 || chunk_size <= 0)
+        {
+          inode_io_end (inode);
+          break;
+        }
+      if (sector_idx == EXTENT_HOLE)
+        memset (buffer + bytes_read, 0, chunk_size);
+      else
+        cache_read_at (buffer + bytes_read, sector_idx, chunk_size,
+                       sector_ofs);
+      inode_io_end (inode);
       
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_read += chunk_size;
     }
+
+  /* Sequential reader, prefetch the sectors that come next */
+  if (bytes_read > 0)
+  {
+    if (sequential)
+    {
+      inode_read_ahead (inode, offset);
+    }
+    else
+    {
+      inode->ahead_end = 0;
+    }
+    inode->next_read = offset;
+  }
   return bytes_read;
 }
 
+/* Asks the read aheader for the sectors of INODE that follow POS,
+   as many as the cache's read-ahead window, skipping those that
+   were already requested. */
+static void
+inode_read_ahead (struct inode *inode, off_t pos)
+{
+  off_t length = inode_length (inode);
+  off_t end = pos + cache_read_ahead_window () * BLOCK_SECTOR_SIZE;
+  off_t ofs = ROUND_UP (pos, BLOCK_SECTOR_SIZE);
+
+  if (ofs < inode->ahead_end)
+    ofs = inode->ahead_end;
+  if (end > length)
+    end = length;
+  for (; ofs < end; ofs += BLOCK_SECTOR_SIZE)
+    {
+      block_sector_t sector = byte_to_sector (inode, ofs);
+
+      if (sector != EXTENT_HOLE)
+        cache_read_ahead (sector);
+    }
+  if (ofs > inode->ahead_end)
+    inode->ahead_end = ofs;
+}
+
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
    less than SIZE if end of file is reached or an error occurs.
@@ -319,7 +451,6 @@ off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
                 off_t offset) 
 {
-  //printf ("Thread%d, [inode_write_at] sector: %d, size: %d, offset: %d\n", thread_current ()->tid,  inode->sector, size, offset);
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
 
@@ -328,13 +459,18 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
     return 0;
   }
 
-  /* First check that inode extension needed */
+  /* First check that inode extension needed, then give the
+     sectors written to sectors */
   inode_extend (inode, size + offset); 
+  if (inode_write_inline (inode, buffer, size, offset, &bytes_written))
+    return bytes_written;
+  inode_allocate (inode, offset, size);
   
   while (size > 0) 
     {
+      inode_io_begin (inode);
       /* Sector to write, starting byte offset within sector. */
-      block_sector_t sector_idx = cache_byte_to_sector (inode->sector, offset);
+      block_sector_t sector_idx = byte_to_sector (inode, offset);
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
@@ -344,9 +480,17 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 
       /* Number of bytes to actually write into this sector. */
       int chunk_size = size < min_left ? size : min_left;
-      if (chunk_size <= 0)
-        break;
-      cache_write_at (sector_idx, (void *) buffer + bytes_written , chunk_size, sector_ofs);
+
+      /* Disk is full, or truncated meanwhile */
+      if (sector_idx == EXTENT_HOLE || sector_idx == (block_sector_t) -1
+          || chunk_size <= 0)
+        {
+          inode_io_end (inode);
+          break;
+        }
+      cache_write_at (sector_idx, (void *) buffer + bytes_written , chunk_size, sector_ofs,
+          inode->sector);
+      inode_io_end (inode);
       
       /* Advance. */
       size -= chunk_size;
@@ -356,12 +500,292 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
   return bytes_written;
 }
 
+/* Longest run of sectors moved by one direct transfer */
+#define DIRECT_RUN_MAX 64
+
+/* Number of whole sectors from OFFSET on, within SIZE bytes, that
+   are contiguous on disk, starting at *FIRST. Returns 0 if OFFSET
+   isn't sector aligned or less than a sector is left. */
+static block_sector_t
+inode_direct_run (struct inode *inode, off_t offset, off_t size,
+                  block_sector_t *first)
+{
+  block_sector_t cnt, run, max;
+  off_t sector_idx;
+
+  if (offset % BLOCK_SECTOR_SIZE != 0 || size < BLOCK_SECTOR_SIZE)
+    return 0;
+  max = size / BLOCK_SECTOR_SIZE;
+  if (max > DIRECT_RUN_MAX)
+    max = DIRECT_RUN_MAX;
+  sector_idx = byte_to_run (inode, offset, &run);
+  if (sector_idx == -1 || sector_idx == EXTENT_HOLE)
+    return 0;
+  *first = sector_idx;
+  /* Extents give the whole run at once, block maps a sector at a
+     time */
+  for (cnt = run < max ? run : max; cnt < max; cnt += run)
+    {
+      sector_idx = byte_to_run (inode, offset + cnt * BLOCK_SECTOR_SIZE,
+                                &run);
+      if (sector_idx != (off_t) (*first + cnt))
+        break;
+    }
+  return cnt < max ? cnt : max;
+}
+
+/* Like inode_read_at(), but whole sectors are read straight from
+   disk into BUFFER, in runs of contiguous sectors, bypassing the
+   buffer cache. Only a partial sector at either end goes through
+   the cache. BUFFER must not page fault. */
+off_t
+inode_read_direct_at (struct inode *inode, void *buffer_, off_t size,
+                      off_t offset)
+{
+  uint8_t *buffer = buffer_;
+  off_t bytes_read = 0;
+  off_t length = inode_length (inode);
+
+  if (offset >= length)
+    return 0;
+  if (size > length - offset)
+    size = length - offset;
+  if (inode_read_inline (inode, buffer, size, offset, &bytes_read))
+    return bytes_read;
+
+  while (size > 0)
+    {
+      block_sector_t first;
+      block_sector_t cnt;
+      int chunk_size;
+
+      inode_io_begin (inode);
+      cnt = inode_direct_run (inode, offset, size, &first);
+      if (cnt > 0)
+        {
+          cache_read_direct (buffer + bytes_read, first, cnt);
+          chunk_size = cnt * BLOCK_SECTOR_SIZE;
+        }
+      else
+        {
+          /* Disk sector to read, starting byte offset within sector. */
+          off_t sector_idx = byte_to_sector (inode, offset);
+          int sector_ofs = offset % BLOCK_SECTOR_SIZE;
+          int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
+
+          if (sector_idx == -1)
+            {
+              inode_io_end (inode);
+              break;
+            }
+          chunk_size = size < sector_left ? size : sector_left;
+          if (sector_idx == EXTENT_HOLE)
+            memset (buffer + bytes_read, 0, chunk_size);
+          else
+            cache_read_at (buffer + bytes_read, sector_idx, chunk_size,
+                           sector_ofs);
+        }
+      inode_io_end (inode);
+
+      /* Advance. */
+      size -= chunk_size;
+      offset += chunk_size;
+      bytes_read += chunk_size;
+    }
+  return bytes_read;
+}
+
+/* Like inode_write_at(), but whole sectors are written straight
+   from BUFFER to disk, bypassing the buffer cache. BUFFER must not
+   page fault. */
+off_t
+inode_write_direct_at (struct inode *inode, const void *buffer_, off_t size,
+                       off_t offset)
+{
+  const uint8_t *buffer = buffer_;
+  off_t bytes_written = 0;
+
+  if (inode->deny_write_cnt)
+  {
+    return 0;
+  }
+
+  inode_extend (inode, size + offset);
+  if (inode_write_inline (inode, buffer, size, offset, &bytes_written))
+    return bytes_written;
+  inode_allocate (inode, offset, size);
+  while (size > 0)
+    {
+      block_sector_t first;
+      block_sector_t cnt;
+      int chunk_size;
+
+      inode_io_begin (inode);
+      cnt = inode_direct_run (inode, offset, size, &first);
+      if (cnt > 0)
+        {
+          cache_write_direct (first, buffer + bytes_written, cnt);
+          chunk_size = cnt * BLOCK_SECTOR_SIZE;
+        }
+      else
+        {
+          /* Sector to write, starting byte offset within sector. */
+          block_sector_t sector_idx = byte_to_sector (inode, offset);
+          int sector_ofs = offset % BLOCK_SECTOR_SIZE;
+          int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
+
+          /* Disk is full, or truncated meanwhile */
+          if (sector_idx == EXTENT_HOLE || sector_idx == (block_sector_t) -1)
+            {
+              inode_io_end (inode);
+              break;
+            }
+          chunk_size = size < sector_left ? size : sector_left;
+          cache_write_at (sector_idx, (void *) buffer + bytes_written,
+                          chunk_size, sector_ofs, inode->sector);
+        }
+      inode_io_end (inode);
+
+      /* Advance. */
+      size -= chunk_size;
+      offset += chunk_size;
+      bytes_written += chunk_size;
+    }
+  return bytes_written;
+}
+
+/* Reloads INODE's copy of its on-disk inode after the block map
+   changed. Lookups that ran meanwhile see map_seq changed and try
+   again. */
+static void
+inode_map_refresh (struct inode *inode)
+{
+  cache_read_at (inode->map, inode->sector, BLOCK_SECTOR_SIZE, 0);
+}
+
+/* If INODE keeps its data inline, copies up to SIZE bytes of it
+   from OFFSET on into BUFFER straight out of INODE's copy of the
+   inode, stores how many in *BYTES_READ and returns true. Returns
+   false if the data is in sectors of its own. */
+static bool
+inode_read_inline (struct inode *inode, void *buffer, off_t size,
+                   off_t offset, off_t *bytes_read)
+{
+  for (;;)
+    {
+      unsigned seq = inode->map_seq;
+      off_t chunk_size;
+
+      barrier ();
+      if (seq % 2 == 0)
+        {
+          /* Inodes only ever leave the inline form */
+          if (inode->map->magic != INLINE_MAGIC)
+            return false;
+          chunk_size = inode->map->length - offset;
+          if (chunk_size > size)
+            chunk_size = size;
+          if (chunk_size < 0)
+            chunk_size = 0;
+          memcpy (buffer, inode->map->data + offset, chunk_size);
+          barrier ();
+          if (inode->map_seq == seq)
+            {
+              *bytes_read = chunk_size;
+              return true;
+            }
+        }
+      lock_acquire (&inode->extension_lock);
+      lock_release (&inode->extension_lock);
+    }
+}
+
+/* If INODE keeps its data inline, writes up to SIZE bytes from
+   BUFFER into it at OFFSET, within its length, stores how many in
+   *BYTES_WRITTEN and returns true. Returns false if the data is in
+   sectors of its own. BUFFER may be a user buffer, so it is copied
+   before the journal handle and any lock are taken, where a page
+   fault would hold up every commit. */
+static bool
+inode_write_inline (struct inode *inode, const void *buffer, off_t size,
+                    off_t offset, off_t *bytes_written)
+{
+  off_t chunk_size;
+  uint8_t *copy;
+
+  if (inode->map->magic != INLINE_MAGIC)
+    return false;
+  chunk_size = inode->length - offset;
+  if (chunk_size > size)
+    chunk_size = size;
+  if (chunk_size <= 0)
+    {
+      *bytes_written = 0;
+      return true;
+    }
+  copy = malloc (chunk_size);
+  if (copy == NULL)
+    {
+      *bytes_written = 0;
+      return true;
+    }
+  memcpy (copy, buffer, chunk_size);
+
+  /* The data is in the inode sector, logged like the rest of it */
+  journal_begin (JOURNAL_WRITE, false);
+  lock_acquire (&inode->extension_lock);
+  if (inode->map->magic != INLINE_MAGIC)
+    {
+      lock_release (&inode->extension_lock);
+      journal_end ();
+      free (copy);
+      return false;
+    }
+  /* It may have been truncated meanwhile */
+  if (chunk_size > inode->length - offset)
+    chunk_size = inode->length > offset ? inode->length - offset : 0;
+  inode->map_seq++;
+  barrier ();
+  cache_write_at (inode->sector, copy, chunk_size,
+                  offsetof (struct inode_disk, data) + offset,
+                  inode->sector);
+  memcpy (inode->map->data + offset, copy, chunk_size);
+  barrier ();
+  inode->map_seq++;
+  lock_release (&inode->extension_lock);
+  journal_end ();
+  free (copy);
+  *bytes_written = chunk_size;
+  return true;
+}
+
+/* Whether any of the SIZE bytes of INODE from OFFSET on lies in a
+   hole */
+static bool
+inode_has_hole (struct inode *inode, off_t offset, off_t size)
+{
+  off_t end = offset + size;
+
+  offset = ROUND_DOWN (offset, BLOCK_SECTOR_SIZE);
+  while (offset < end)
+    {
+      block_sector_t cnt;
+      block_sector_t sector = byte_to_run (inode, offset, &cnt);
+
+      if (sector == EXTENT_HOLE)
+        return true;
+      if (sector == (block_sector_t) -1)
+        break;
+      offset += cnt * BLOCK_SECTOR_SIZE;
+    }
+  return false;
+}
+
 /* Disables writes to INODE.
    May be called at most once per inode opener. */
 void
 inode_deny_write (struct inode *inode) 
 {
-  //printf ("[inode_deny_write] sector: %d\n", inode->sector);
   inode->deny_write_cnt++;
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
 }
@@ -372,7 +796,6 @@ inode_deny_write (struct inode *inode)
 void
 inode_allow_write (struct inode *inode) 
 {
-  //printf ("[inode_allow_write] sector: %d\n", inode->sector);
   ASSERT (inode->deny_write_cnt > 0);
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
   inode->deny_write_cnt--;
@@ -382,15 +805,132 @@ inode_allow_write (struct inode *inode)
 off_t
 inode_length (const struct inode *inode)
 {
-  //printf ("[inode_length] sector: %d\n", inode->sector);
-  return cache_inode_length (inode->sector);
+  return inode->length;
 }
 
-void
+/* Grows INODE to NEW_POS bytes if it is shorter. Returns false if
+   the disk is full, INODE then keeps its length. */
+bool
 inode_extend (struct inode *inode, size_t new_pos)
 {
-  //printf ("[inode_extend] sector: %d, new_pos: %d\n", inode->sector, new_pos);
+  bool success;
+
+  if ((off_t) new_pos <= inode->length)
+    return true;
+  journal_begin (JOURNAL_EXTEND, true);
   lock_acquire (&inode->extension_lock);
-  cache_inode_extend (inode->sector, new_pos);
+  inode->map_seq++;
+  barrier ();
+  success = cache_inode_extend (inode->sector, new_pos);
+  inode_map_refresh (inode);
+  inode->length = inode->map->length;
+  barrier ();
+  inode->map_seq++;
   lock_release (&inode->extension_lock);
+  journal_end ();
+  return success;
+}
+
+/* Sets the length of INODE to LENGTH bytes. Growing adds a hole,
+   shrinking releases the sectors past the new end. Returns false
+   if writes to INODE are denied, it is a directory, which can't
+   shrink, or the disk is full. */
+bool
+inode_truncate (struct inode *inode, off_t length)
+{
+  bool success;
+
+  ASSERT (length >= 0);
+  if (inode->deny_write_cnt)
+    return false;
+  if (length >= inode->length)
+    return inode_extend (inode, length);
+  journal_begin (JOURNAL_TRUNCATE, true);
+
+  /* Wait for reads and writes that may have looked up a sector
+     about to be freed, and keep new ones out until it is done */
+  lock_acquire (&inode->io_lock);
+  while (inode->truncating)
+    cond_wait (&inode->io_idle, &inode->io_lock);
+  inode->truncating = true;
+  while (inode->io_cnt > 0)
+    cond_wait (&inode->io_idle, &inode->io_lock);
+  lock_release (&inode->io_lock);
+
+  lock_acquire (&inode->extension_lock);
+  inode->map_seq++;
+  barrier ();
+  success = cache_inode_truncate (inode->sector, length);
+  inode_map_refresh (inode);
+  inode->length = inode->map->length;
+  inode->next_read = 0;
+  inode->ahead_end = 0;
+  barrier ();
+  inode->map_seq++;
+  lock_release (&inode->extension_lock);
+
+  lock_acquire (&inode->io_lock);
+  inode->truncating = false;
+  cond_broadcast (&inode->io_idle, &inode->io_lock);
+  lock_release (&inode->io_lock);
+  journal_end ();
+  return success;
+}
+
+/* Starts a read or write of one chunk of INODE, from looking up
+   its sector to copying its data, which a truncate must not free
+   in between. Waits while a truncate runs. */
+static void
+inode_io_begin (struct inode *inode)
+{
+  lock_acquire (&inode->io_lock);
+  while (inode->truncating)
+    cond_wait (&inode->io_idle, &inode->io_lock);
+  inode->io_cnt++;
+  lock_release (&inode->io_lock);
+}
+
+/* Ends what inode_io_begin() started */
+static void
+inode_io_end (struct inode *inode)
+{
+  lock_acquire (&inode->io_lock);
+  if (--inode->io_cnt == 0)
+    cond_broadcast (&inode->io_idle, &inode->io_lock);
+  lock_release (&inode->io_lock);
+}
+
+/* Gives sectors to the holes in the SIZE bytes of INODE from OFFSET
+   on, which must be within its length and which the caller then
+   writes, so that sectors it covers in full aren't zeroed first.
+   Sectors reserved for growth are used first, except for the free
+   map file, whose size is fixed. Each run of sectors is added in a
+   journal handle of its own, so that a large write logs no more
+   than a handle may. Returns false if the disk is full. */
+bool
+inode_allocate (struct inode *inode, off_t offset, off_t size)
+{
+  struct extent *prealloc = (inode->sector != FREE_MAP_SECTOR
+                             ? &inode->prealloc : NULL);
+  off_t end = offset + size;
+  bool success = true;
+
+  if (inode->map->magic != EXTENT_MAGIC
+      || !inode_has_hole (inode, offset, size))
+    return true;
+  while (success && offset < end)
+    {
+      journal_begin (JOURNAL_FILL, true);
+      lock_acquire (&inode->extension_lock);
+      inode->map_seq++;
+      barrier ();
+      success = cache_inode_fill (inode->sector, offset, end - offset,
+                                  prealloc, &offset);
+      inode_map_refresh (inode);
+      barrier ();
+      inode->map_seq++;
+      lock_release (&inode->extension_lock);
+      journal_end ();
+    }
+  return success;
 }
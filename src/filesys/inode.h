@@ -5,12 +5,28 @@
 #include "filesys/off_t.h"
 #include "devices/block.h"
 #include <list.h>
+#include <hash.h>
 #include "threads/synch.h"
 
 #define DIRECT_BLOCK 123
 #define INDIRECT_BLOCK 1
 #define DOUBLY_INDIRECT_BLOCK 1
 #define INDEX_BLOCK 128
+#define EXTENT_INLINE 61
+#define EXTENT_BLOCK 63
+
+/* Identifies an inode, and which block map it uses. */
+#define INODE_MAGIC 0x494e4f44          /* Direct and indirect blocks */
+#define EXTENT_MAGIC 0x494e4f58         /* Extents */
+#define INLINE_MAGIC 0x494e4f49         /* Data inside the inode */
+
+/* Most bytes of data an INLINE_MAGIC inode holds, the room the
+   block maps take up. */
+#define INODE_INLINE_MAX 500
+
+/* Start of an extent that is a hole, sectors not written yet which
+   read as zeros. Sector 0 holds the free map, never file data. */
+#define EXTENT_HOLE 0
 
 struct bitmap;
 
@@ -21,17 +37,39 @@ enum inode_type
   INODE_DIR,    /* Directory inode */
 };
 
+/* Run of LENGTH sectors on disk starting at START. */
+struct extent
+  {
+    block_sector_t start;
+    block_sector_t length;
+  };
+
 /* In-memory inode. */
 struct inode 
   {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem elem;              /* Element in open_inodes. */
     block_sector_t sector;              /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
     struct lock extension_lock;         /* Extension lock */
     enum inode_type type;               /* Inode type (INODE_FILE or INODE_DIR */
+    off_t length;                       /* File size in bytes, kept in step
+                                           with the inode sector */
     off_t pos;                          /* If directory, current position */    
+    off_t next_read;                    /* Offset right after the last read */
+    off_t ahead_end;                    /* Read ahead requested up to here */
+    struct extent prealloc;             /* Reserved for growth, released
+                                           on last close */
+    struct inode_disk *map;             /* Copy of the on-disk inode for
+                                           offset translation */
+    unsigned map_seq;                   /* Odd while the block map is
+                                           being changed */
+    struct lock io_lock;                /* Protects IO_CNT, TRUNCATING */
+    struct condition io_idle;           /* Signaled when either drops */
+    int io_cnt;                         /* Reads and writes between a
+                                           lookup and its copy */
+    bool truncating;                    /* Truncate holds off new I/O */
   };
 
 /* On-disk inode.
@@ -40,15 +78,40 @@ struct inode_disk
   {
     off_t length;                       /* File size in bytes */
     enum inode_type type;               /* Inode type */
-    block_sector_t direct[DIRECT_BLOCK];                
-    block_sector_t indirect[INDIRECT_BLOCK];          
-    block_sector_t doubly_indirect[DOUBLY_INDIRECT_BLOCK];    
+    union
+      {
+        /* Block map of INODE_MAGIC inodes */
+        struct
+          {
+            block_sector_t direct[DIRECT_BLOCK];                
+            block_sector_t indirect[INDIRECT_BLOCK];          
+            block_sector_t doubly_indirect[DOUBLY_INDIRECT_BLOCK];    
+          };
+        /* Block map of EXTENT_MAGIC inodes, the file's sectors are
+           its extents in order */
+        struct
+          {
+            uint32_t extent_cnt;        /* Extents used in EXTENTS */
+            struct extent extents[EXTENT_INLINE];
+            block_sector_t extent_next; /* First extent_disk, 0 if none */
+          };
+        /* Contents of INLINE_MAGIC inodes, zeros past LENGTH */
+        uint8_t data[INODE_INLINE_MAX];
+      };
     unsigned magic;                     /* Magic number. */
   };
 
 struct index_disk
   {
     block_sector_t index[INDEX_BLOCK];
+  };
+
+/* Extents that don't fit in the inode, in a chain of blocks. */
+struct extent_disk
+  {
+    uint32_t extent_cnt;                /* Extents used in EXTENTS */
+    block_sector_t next;                /* Next extent_disk, 0 if none */
+    struct extent extents[EXTENT_BLOCK];
   };      
 
 void inode_init (void);
@@ -57,11 +120,17 @@ struct inode *inode_open (block_sector_t);
 struct inode *inode_reopen (struct inode *);
 block_sector_t inode_get_inumber (const struct inode *);
 void inode_close (struct inode *);
+void inode_sync (struct inode *);
 void inode_remove (struct inode *);
 off_t inode_read_at (struct inode *, void *, off_t size, off_t offset);
 off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
+off_t inode_read_direct_at (struct inode *, void *, off_t size, off_t offset);
+off_t inode_write_direct_at (struct inode *, const void *, off_t size,
+                             off_t offset);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
 off_t inode_length (const struct inode *);
-void inode_extend (struct inode *, size_t);
+bool inode_extend (struct inode *, size_t);
+bool inode_allocate (struct inode *, off_t offset, off_t size);
+bool inode_truncate (struct inode *, off_t);
 #endif /* filesys/inode.h */
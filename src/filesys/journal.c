@@ -0,0 +1,576 @@
+#include "filesys/journal.h"
+#include <debug.h>
+#include <hash.h>
+#include <round.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/cache.h"
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+
+/* Metadata changes are logged before they reach their home
+   sectors. The changes every thread makes between two commits
+   form one transaction, written to the log as one run of sectors:
+   a descriptor listing the home sectors, their images, and a
+   commit record whose checksum tells a whole record from a torn
+   one. Logged sectors are held in the cache until they are
+   committed, and go home later through the usual write-back, or
+   at the latest when the log fills up.
+
+   Each handle reserves room in the running transaction for as
+   many sectors as it may log when it begins, so a transaction
+   never outgrows the cache or the log. If there is no room left,
+   the handle waits for the transaction to commit. */
+
+/* Magic numbers of journal sectors. */
+#define JOURNAL_MAGIC 0x4a524e4c        /* Header. */
+#define DESC_MAGIC 0x4a44534b           /* Descriptor. */
+#define COMMIT_MAGIC 0x4a434d54         /* Commit record. */
+
+/* The log proper, after the header. */
+#define LOG_START (JOURNAL_SECTOR + 1)
+#define LOG_SECTORS (JOURNAL_SECTORS - 1)
+
+/* Sector numbers a descriptor holds. */
+#define DESC_MAX ((BLOCK_SECTOR_SIZE - 4 * sizeof (uint32_t)) \
+                  / sizeof (block_sector_t))
+
+/* Pages of the buffer records are put together in. */
+#define RECORD_PAGES DIV_ROUND_UP ((JOURNAL_TXN_MAX + 2) \
+                                   * BLOCK_SECTOR_SIZE, PGSIZE)
+
+/* First sector of the journal. */
+struct journal_header
+  {
+    uint32_t magic;
+    uint32_t seq;                       /* Number of the first record
+                                           in the log. */
+    uint8_t unused[BLOCK_SECTOR_SIZE - 2 * sizeof (uint32_t)];
+  };
+
+/* First sector of a record. */
+struct journal_desc
+  {
+    uint32_t magic;
+    uint32_t seq;                       /* Record number. */
+    uint32_t cnt;                       /* Images that follow. */
+    uint32_t revoke_cnt;                /* Sectors revoked. */
+    block_sector_t sectors[DESC_MAX];   /* Home sectors of the images,
+                                           then the revoked ones. */
+  };
+
+/* Last sector of a record. */
+struct journal_commit
+  {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t checksum;                  /* Of descriptor and images. */
+    uint8_t unused[BLOCK_SECTOR_SIZE - 3 * sizeof (uint32_t)];
+  };
+
+/* A transaction, what handles changed since the last commit. */
+struct txn
+  {
+    uint32_t seq;                       /* Number of its record. */
+    size_t cnt;
+    block_sector_t sectors[JOURNAL_TXN_MAX];    /* Sectors changed. */
+    size_t revoke_cnt;
+    block_sector_t revoked[LOG_SECTORS];        /* Sectors freed that
+                                                   have images in the
+                                                   log. */
+  };
+
+/* A sector with an image in the log, at POS for the latest. */
+struct log_image
+  {
+    block_sector_t sector;
+    size_t pos;
+  };
+
+/* A sector revoked by record SEQ, while replaying. */
+struct revoke
+  {
+    block_sector_t sector;
+    uint32_t seq;
+  };
+
+static bool enabled;                    /* There is a journal on disk. */
+static struct lock journal_lock;        /* Protects all of these. */
+static struct condition journal_idle;   /* Handles or a commit ended. */
+static int handle_cnt;                  /* Outermost handles open. */
+static bool committing;                 /* A thread owns the log. */
+static struct txn running;              /* Transaction handles add to. */
+static size_t reserved;                 /* Sectors open handles may
+                                           still add to it. */
+static size_t txn_max;                  /* Most sectors in it. */
+static size_t free_map_credits;         /* Sectors of the free map
+                                           file. */
+static uint32_t committed_seq;          /* Last record written. */
+static struct log_image images[LOG_SECTORS];    /* Images in the log. */
+static size_t image_cnt;
+
+/* Only used by the thread that owns the log. */
+static size_t log_head;                 /* Next free log sector. */
+static struct txn commit_txn;           /* Transaction being written. */
+static uint8_t *record;                 /* RECORD_PAGES of buffer. */
+
+static void journal_do_commit (void);
+static void journal_write (struct txn *);
+static void journal_checkpoint (uint32_t seq);
+static void journal_write_header (uint32_t seq);
+static bool journal_replay (uint32_t *seq);
+static bool journal_read_record (size_t pos, uint32_t seq);
+static void journal_note_image (block_sector_t, size_t);
+static bool txn_empty (const struct txn *);
+
+/* Initializes the journal module. Nothing is logged until
+   journal_open(). */
+void
+journal_init (void)
+{
+  lock_init (&journal_lock);
+  cond_init (&journal_idle);
+  record = palloc_get_multiple (0, RECORD_PAGES);
+  if (record == NULL)
+    PANIC ("journal buffer allocation failed");
+}
+
+/* Writes an empty journal, when formatting. */
+void
+journal_create (void)
+{
+  journal_write_header (1);
+}
+
+/* Replays what was committed to the journal and not checkpointed
+   yet, then starts logging in an empty log. A file system made
+   before there was a journal is used without one, and so is one
+   too large for the largest handle and every sector of its free
+   map to fit in a transaction. Must be called before anything
+   else reads the file system. */
+void
+journal_open (void)
+{
+  uint32_t seq;
+
+  if (!journal_replay (&seq))
+    return;
+
+  journal_write_header (seq);
+  txn_max = cache_log_max ();
+  free_map_credits = DIV_ROUND_UP (block_size (fs_device),
+                                   BLOCK_SECTOR_SIZE * 8);
+  if (JOURNAL_HANDLE_MAX + free_map_credits > txn_max)
+    {
+      printf ("journal: file system too large to log in %zu cache "
+              "entries, not journaling (use -cache to cache more)\n",
+              txn_max);
+      return;
+    }
+  running.seq = seq;
+  committed_seq = seq - 1;
+  enabled = true;
+}
+
+/* Commits what is pending and gets every logged sector home,
+   leaving an empty log, for shutdown. Later changes aren't
+   logged. */
+void
+journal_close (void)
+{
+  if (!enabled)
+    return;
+  journal_commit ();
+  lock_acquire (&journal_lock);
+  while (committing)
+    cond_wait (&journal_idle, &journal_lock);
+  committing = true;
+  lock_release (&journal_lock);
+
+  journal_checkpoint (running.seq);
+
+  lock_acquire (&journal_lock);
+  enabled = false;
+  committing = false;
+  cond_broadcast (&journal_idle, &journal_lock);
+  lock_release (&journal_lock);
+}
+
+/* Opens a handle, within which the changes the current thread
+   makes are logged in the running transaction, which won't
+   commit until the handle ends. Room is reserved for the sectors
+   the handle may log, committing the running transaction first if
+   there is not enough. CREDITS is how many sectors the handle
+   logs at most, besides the free map file, every sector of which
+   is reserved too if FREE_MAP, since releasing sectors may change
+   any of them. Handles nest, inner ones share the room of the
+   outermost. Must be called before taking any lock the file
+   system uses, since it may wait for a commit. */
+void
+journal_begin (size_t credits, bool free_map)
+{
+  struct thread *t = thread_current ();
+
+  if (t->journal_depth++ > 0)
+    return;
+  ASSERT (credits <= JOURNAL_HANDLE_MAX);
+  if (free_map)
+    credits += free_map_credits;
+  lock_acquire (&journal_lock);
+  for (;;)
+    {
+      while (committing)
+        cond_wait (&journal_idle, &journal_lock);
+      if (!enabled || running.cnt + reserved + credits <= txn_max)
+        break;
+      journal_do_commit ();
+    }
+  if (enabled)
+    {
+      t->journal_credits = credits;
+      reserved += credits;
+    }
+  handle_cnt++;
+  lock_release (&journal_lock);
+}
+
+/* Ends a handle begun with journal_begin(), giving back the room
+   it didn't use. */
+void
+journal_end (void)
+{
+  struct thread *t = thread_current ();
+
+  ASSERT (t->journal_depth > 0);
+  if (--t->journal_depth > 0)
+    return;
+  lock_acquire (&journal_lock);
+  reserved -= t->journal_credits;
+  t->journal_credits = 0;
+  if (--handle_cnt == 0)
+    cond_broadcast (&journal_idle, &journal_lock);
+  lock_release (&journal_lock);
+}
+
+/* Whether changes the current thread makes are logged. */
+bool
+journal_active (void)
+{
+  return enabled && thread_current ()->journal_depth > 0;
+}
+
+/* Adds SECTOR, just changed within a handle, to the running
+   transaction, out of the room the handle reserved. A handle that
+   logs more than it reserved may use room nobody else did, and
+   panics if there is none. */
+void
+journal_add (block_sector_t sector)
+{
+  struct thread *t = thread_current ();
+  size_t i;
+
+  lock_acquire (&journal_lock);
+  for (i = 0; i < running.cnt; i++)
+    if (running.sectors[i] == sector)
+      break;
+  if (i == running.cnt)
+    {
+      if (t->journal_credits > 0)
+        {
+          t->journal_credits--;
+          reserved--;
+        }
+      else if (running.cnt + reserved >= txn_max)
+        PANIC ("journal handle logged more than it reserved");
+      running.sectors[running.cnt++] = sector;
+    }
+  lock_release (&journal_lock);
+}
+
+/* Notes that the CNT sectors from SECTOR on were freed. Their
+   images in the log must not be replayed over what they hold
+   next, and their changes that aren't committed yet are
+   dropped. */
+void
+journal_revoke (block_sector_t sector, size_t cnt)
+{
+  block_sector_t forget[JOURNAL_TXN_MAX + LOG_SECTORS];
+  size_t forget_cnt = 0;
+  size_t i, j;
+
+  if (!enabled)
+    return;
+  lock_acquire (&journal_lock);
+  for (i = 0; i < running.cnt; )
+    if (running.sectors[i] - sector < cnt)
+      {
+        forget[forget_cnt++] = running.sectors[i];
+        running.sectors[i] = running.sectors[--running.cnt];
+      }
+    else
+      i++;
+  for (i = 0; i < image_cnt; i++)
+    if (images[i].sector - sector < cnt)
+      {
+        for (j = 0; j < running.revoke_cnt; j++)
+          if (running.revoked[j] == images[i].sector)
+            break;
+        if (j == running.revoke_cnt && j < LOG_SECTORS)
+          running.revoked[running.revoke_cnt++] = images[i].sector;
+        forget[forget_cnt++] = images[i].sector;
+      }
+  lock_release (&journal_lock);
+
+  for (i = 0; i < forget_cnt; i++)
+    cache_log_forget (forget[i]);
+}
+
+/* Makes the changes of every handle ended so far durable. Threads
+   calling this together share one commit. Does nothing within a
+   handle, whose changes can't commit before it ends. */
+void
+journal_commit (void)
+{
+  uint32_t target;
+
+  if (!enabled || thread_current ()->journal_depth > 0)
+    return;
+  lock_acquire (&journal_lock);
+  /* An empty running transaction leaves waiting for the one being
+     written, if any */
+  target = txn_empty (&running) ? running.seq - 1 : running.seq;
+  while (enabled && committed_seq < target)
+    {
+      if (committing)
+        cond_wait (&journal_idle, &journal_lock);
+      else
+        journal_do_commit ();
+    }
+  lock_release (&journal_lock);
+}
+
+/* Commits the running transaction once the handles in it end,
+   holding off new ones meanwhile. journal_lock must be held, and
+   is released while writing. */
+static void
+journal_do_commit (void)
+{
+  struct txn *t = &commit_txn;
+
+  ASSERT (!committing);
+  committing = true;
+  while (handle_cnt > 0)
+    cond_wait (&journal_idle, &journal_lock);
+  if (txn_empty (&running))
+    {
+      committing = false;
+      cond_broadcast (&journal_idle, &journal_lock);
+      return;
+    }
+  *t = running;
+  running.seq++;
+  running.cnt = 0;
+  running.revoke_cnt = 0;
+  lock_release (&journal_lock);
+
+  journal_write (t);
+  /* What it freed may be used again, no replay brings back the old
+     contents now */
+  free_map_reclaim ();
+
+  lock_acquire (&journal_lock);
+  committed_seq = t->seq;
+  committing = false;
+  cond_broadcast (&journal_idle, &journal_lock);
+}
+
+/* Writes T to the log as one record, checkpointing first if it
+   doesn't fit. Its sectors may go home once it is written. The
+   caller owns the log. */
+static void
+journal_write (struct txn *t)
+{
+  struct journal_desc *desc = (struct journal_desc *) record;
+  struct journal_commit *commit;
+  size_t n = 0;
+  size_t i;
+
+  if (log_head + t->cnt + 2 > LOG_SECTORS)
+    journal_checkpoint (t->seq);
+
+  /* Sectors freed since they were changed are left out */
+  memset (desc, 0, BLOCK_SECTOR_SIZE);
+  for (i = 0; i < t->cnt; i++)
+    if (cache_log_copy (t->sectors[i], record + (n + 1) * BLOCK_SECTOR_SIZE))
+      desc->sectors[n++] = t->sectors[i];
+  desc->magic = DESC_MAGIC;
+  desc->seq = t->seq;
+  desc->cnt = n;
+  desc->revoke_cnt = t->revoke_cnt;
+  memcpy (desc->sectors + n, t->revoked,
+          t->revoke_cnt * sizeof *t->revoked);
+
+  commit = (struct journal_commit *) (record + (n + 1) * BLOCK_SECTOR_SIZE);
+  memset (commit, 0, BLOCK_SECTOR_SIZE);
+  commit->magic = COMMIT_MAGIC;
+  commit->seq = t->seq;
+  commit->checksum = hash_bytes (record, (n + 1) * BLOCK_SECTOR_SIZE);
+  block_write_multiple (fs_device, LOG_START + log_head, record, n + 2);
+
+  lock_acquire (&journal_lock);
+  for (i = 0; i < n; i++)
+    journal_note_image (desc->sectors[i], log_head + 1 + i);
+  lock_release (&journal_lock);
+  log_head += n + 2;
+  for (i = 0; i < n; i++)
+    cache_log_done (desc->sectors[i]);
+}
+
+/* Gets every image in the log to its home sector, so that the log
+   can start over with record SEQ. Sectors go home from the cache,
+   except those changed again by the transaction being committed,
+   which are copied from the log. The caller owns the log. */
+static void
+journal_checkpoint (uint32_t seq)
+{
+  size_t i;
+
+  cache_checkpoint ();
+  for (i = 0; i < image_cnt; i++)
+    if (cache_log_held (images[i].sector))
+      {
+        block_read (fs_device, LOG_START + images[i].pos, record);
+        block_write (fs_device, images[i].sector, record);
+      }
+  journal_write_header (seq);
+
+  lock_acquire (&journal_lock);
+  image_cnt = 0;
+  lock_release (&journal_lock);
+  log_head = 0;
+}
+
+/* Writes a header for an empty log whose first record will be
+   SEQ. The caller owns the log. */
+static void
+journal_write_header (uint32_t seq)
+{
+  static struct journal_header header;
+
+  header.magic = JOURNAL_MAGIC;
+  header.seq = seq;
+  block_write (fs_device, JOURNAL_SECTOR, &header);
+}
+
+/* Copies the images of every whole record in the log to their
+   home sectors, except for sectors a later record revokes, and
+   stores the number for the next record in *SEQ. Returns false if
+   there is no journal. */
+static bool
+journal_replay (uint32_t *seq)
+{
+  static struct journal_header header;
+  struct journal_desc *desc = (struct journal_desc *) record;
+  struct revoke revoked[LOG_SECTORS];
+  size_t revoke_cnt = 0;
+  uint32_t first;
+  size_t pos, end, i, j;
+
+  block_read (fs_device, JOURNAL_SECTOR, &header);
+  if (header.magic != JOURNAL_MAGIC)
+    return false;
+
+  /* Find the whole records and what they revoke */
+  first = *seq = header.seq;
+  for (pos = 0; journal_read_record (pos, *seq); pos += desc->cnt + 2)
+    {
+      for (i = 0; i < desc->revoke_cnt; i++)
+        {
+          block_sector_t sector = desc->sectors[desc->cnt + i];
+
+          for (j = 0; j < revoke_cnt; j++)
+            if (revoked[j].sector == sector)
+              break;
+          if (j == LOG_SECTORS)
+            break;
+          revoked[j].sector = sector;
+          revoked[j].seq = *seq;
+          if (j == revoke_cnt)
+            revoke_cnt++;
+        }
+      /* More revoked than a log can hold images of, corrupt */
+      if (i < desc->revoke_cnt)
+        break;
+      (*seq)++;
+    }
+  end = pos;
+
+  for (pos = 0; pos < end; pos += desc->cnt + 2, first++)
+    {
+      journal_read_record (pos, first);
+      for (i = 0; i < desc->cnt; i++)
+        {
+          for (j = 0; j < revoke_cnt; j++)
+            if (revoked[j].sector == desc->sectors[i]
+                && revoked[j].seq > first)
+              break;
+          if (j == revoke_cnt)
+            block_write (fs_device, desc->sectors[i],
+                         record + (i + 1) * BLOCK_SECTOR_SIZE);
+        }
+    }
+  return true;
+}
+
+/* Reads the record at log sector POS into the record buffer.
+   Returns false unless it is whole and numbered SEQ. */
+static bool
+journal_read_record (size_t pos, uint32_t seq)
+{
+  struct journal_desc *desc = (struct journal_desc *) record;
+  struct journal_commit *commit;
+
+  if (pos + 2 > LOG_SECTORS)
+    return false;
+  block_read (fs_device, LOG_START + pos, desc);
+  if (desc->magic != DESC_MAGIC || desc->seq != seq
+      || desc->cnt > JOURNAL_TXN_MAX
+      || desc->revoke_cnt > DESC_MAX - desc->cnt
+      || pos + desc->cnt + 2 > LOG_SECTORS)
+    return false;
+  block_read_multiple (fs_device, LOG_START + pos + 1,
+                       record + BLOCK_SECTOR_SIZE, desc->cnt + 1);
+  commit = (struct journal_commit *) (record + (desc->cnt + 1)
+                                      * BLOCK_SECTOR_SIZE);
+  return (commit->magic == COMMIT_MAGIC && commit->seq == seq
+          && commit->checksum == hash_bytes (record, (desc->cnt + 1)
+                                             * BLOCK_SECTOR_SIZE));
+}
+
+/* Notes that the latest image of SECTOR is at log sector POS.
+   journal_lock must be held. */
+static void
+journal_note_image (block_sector_t sector, size_t pos)
+{
+  size_t i;
+
+  for (i = 0; i < image_cnt; i++)
+    if (images[i].sector == sector)
+      break;
+  images[i].sector = sector;
+  images[i].pos = pos;
+  if (i == image_cnt)
+    image_cnt++;
+}
+
+/* Whether T changed nothing. */
+static bool
+txn_empty (const struct txn *t)
+{
+  return t->cnt == 0 && t->revoke_cnt == 0;
+}
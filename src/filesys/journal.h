@@ -0,0 +1,56 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "devices/block.h"
+
+/* Most sectors one transaction logs. */
+#define JOURNAL_TXN_MAX 48
+
+/* Sectors each kind of handle may log, besides those of the free
+   map file. Zeroed data sectors aren't logged, only sectors written
+   through the cache are. */
+
+/* Data written into an inline inode: the inode. */
+#define JOURNAL_WRITE 1
+
+/* Growing by one sector of data, or by a hole. A directory logs the
+   new sector, which it zeroes through the cache, its inode and at
+   most two index blocks. An extent inode logs the block with its
+   last extent, a block chained after it and the inode; converting
+   an inline one logs the inode and the sector its data moves to. */
+#define JOURNAL_EXTEND 4
+
+/* Giving one run of sectors to a hole: the block with the hole's
+   extent, and the two blocks that may be chained after it for the
+   pieces of the hole that are left. */
+#define JOURNAL_FILL 3
+
+/* Shrinking: the last sector kept, whose tail is zeroed, the inode
+   and the block that now ends the extent chain. */
+#define JOURNAL_TRUNCATE 3
+
+/* Creating a file or directory: the new inode and a directory's
+   first data sector, and the entry added to the parent, which may
+   straddle its last sector and one it grows by. */
+#define JOURNAL_CREATE (2 + 1 + JOURNAL_EXTEND)
+
+/* Removing a directory entry: the sector holding it. */
+#define JOURNAL_REMOVE 1
+
+/* Largest of the above. */
+#define JOURNAL_HANDLE_MAX JOURNAL_CREATE
+
+void journal_init (void);
+void journal_create (void);
+void journal_open (void);
+void journal_close (void);
+void journal_begin (size_t credits, bool free_map);
+void journal_end (void);
+bool journal_active (void);
+void journal_add (block_sector_t);
+void journal_revoke (block_sector_t, size_t);
+void journal_commit (void);
+
+#endif /* filesys/journal.h */
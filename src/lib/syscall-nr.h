@@ -28,7 +28,11 @@ enum
     SYS_MKDIR,                  /* Create a directory. */
     SYS_READDIR,                /* Reads a directory entry. */
     SYS_ISDIR,                  /* Tests if a fd represents a directory. */
-    SYS_INUMBER                 /* Returns the inode number for a fd. */
+    SYS_INUMBER,                /* Returns the inode number for a fd. */
+    SYS_FSYNC,                  /* Writes a file's cached data to disk. */
+    SYS_OPEN_DIRECT,            /* Opens a file bypassing the cache. */
+    SYS_TRUNCATE,               /* Sets the size of a file. */
+    SYS_FTRUNCATE               /* Sets the size of an open file. */
   };
 
 #endif /* lib/syscall-nr.h */
@@ -182,3 +182,27 @@ inumber (int fd)
 {
   return syscall1 (SYS_INUMBER, fd);
 }
+
+bool
+fsync (int fd)
+{
+  return syscall1 (SYS_FSYNC, fd);
+}
+
+int
+open_direct (const char *file)
+{
+  return syscall1 (SYS_OPEN_DIRECT, file);
+}
+
+bool
+truncate (const char *file, unsigned length)
+{
+  return syscall2 (SYS_TRUNCATE, file, length);
+}
+
+bool
+ftruncate (int fd, unsigned length)
+{
+  return syscall2 (SYS_FTRUNCATE, fd, length);
+}
@@ -44,5 +44,9 @@ bool mkdir (const char *dir);
 bool readdir (int fd, char name[READDIR_MAX_LEN + 1]);
 bool isdir (int fd);
 int inumber (int fd);
+bool fsync (int fd);
+int open_direct (const char *file);
+bool truncate (const char *file, unsigned length);
+bool ftruncate (int fd, unsigned length);
 
 #endif /* lib/user/syscall.h */
@@ -0,0 +1,48 @@
+/* Child process for trunc-race.
+   Writes the first RACE_SIZE bytes of a file our parent process
+   keeps truncating with 'x's, ROUND_CNT times over, in chunks that
+   cover sectors both in full and in part. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/filesys/extended/trunc-race.h"
+#include "tests/lib.h"
+
+const char *test_name = "child-trunc-race";
+
+static char buf[CHUNK_SIZE];
+
+int
+main (int argc, const char *argv[]) 
+{
+  int child_idx;
+  int fd;
+  int round;
+
+  quiet = true;
+  
+  CHECK (argc == 2, "argc must be 2, actually %d", argc);
+  child_idx = atoi (argv[1]);
+
+  memset (buf, 'x', sizeof buf);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  for (round = 0; round < ROUND_CNT; round++)
+    {
+      size_t ofs;
+
+      seek (fd, 0);
+      for (ofs = 0; ofs < RACE_SIZE; ofs += CHUNK_SIZE)
+        {
+          size_t size = RACE_SIZE - ofs < CHUNK_SIZE ? RACE_SIZE - ofs
+                                                     : CHUNK_SIZE;
+
+          CHECK (write (fd, buf, size) >= 0,
+                 "write %zu bytes at offset %zu in \"%s\"",
+                 size, ofs, file_name);
+        }
+    }
+  close (fd);
+
+  return child_idx;
+}
@@ -0,0 +1,14 @@
+/* Tries to open_direct() a file that does not exist, which must
+   fail. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void) 
+{
+  int handle = open_direct ("no-such-file");
+  if (handle != -1)
+    fail ("open_direct() returned %d", handle);
+}
@@ -0,0 +1,10 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(direct-open-missing) begin
+(direct-open-missing) end
+direct-open-missing: exit(0)
+EOF
+pass;
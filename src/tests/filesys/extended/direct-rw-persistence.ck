@@ -0,0 +1,10 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+my ($a) = random_bytes (1636);
+my ($b) = random_bytes (1636);
+substr ($b, 300, 1000) = random_bytes (1000);
+check_archive ({"direct" => [$b]});
+pass;
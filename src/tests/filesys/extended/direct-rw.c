@@ -0,0 +1,54 @@
+/* Reads through an fd from open_direct() what was written through
+   the buffer cache, then writes through it and checks that opening
+   the file normally sees the new data. Then, with the file cached
+   by that check, writes a range that starts and ends partway into
+   a sector directly, which a normal open must see too rather than
+   the cached copies. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_SIZE (3 * 512 + 100)
+static char buf_a[FILE_SIZE];
+static char buf_b[FILE_SIZE];
+
+void
+test_main (void) 
+{
+  int fd, direct_fd;
+
+  random_init (0);
+  random_bytes (buf_a, sizeof buf_a);
+  random_bytes (buf_b, sizeof buf_b);
+
+  CHECK (create ("direct", 0), "create \"direct\"");
+  CHECK ((fd = open ("direct")) > 1, "open \"direct\"");
+  CHECK (write (fd, buf_a, sizeof buf_a) == sizeof buf_a,
+         "write \"direct\"");
+  CHECK ((direct_fd = open_direct ("direct")) > 1,
+         "open_direct \"direct\"");
+  check_file_handle (direct_fd, "direct", buf_a, sizeof buf_a);
+  msg ("close \"direct\"");
+  close (fd);
+
+  msg ("seek \"direct\" to 0");
+  seek (direct_fd, 0);
+  CHECK (write (direct_fd, buf_b, sizeof buf_b) == sizeof buf_b,
+         "write \"direct\" directly");
+  msg ("close \"direct\"");
+  close (direct_fd);
+  check_file ("direct", buf_b, sizeof buf_b);
+
+  random_bytes (buf_b + 300, 1000);
+  CHECK ((direct_fd = open_direct ("direct")) > 1,
+         "open_direct \"direct\"");
+  msg ("seek \"direct\" to 300");
+  seek (direct_fd, 300);
+  CHECK (write (direct_fd, buf_b + 300, 1000) == 1000,
+         "write 1000 bytes to \"direct\" directly");
+  msg ("close \"direct\"");
+  close (direct_fd);
+  check_file ("direct", buf_b, sizeof buf_b);
+}
@@ -0,0 +1,28 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(direct-rw) begin
+(direct-rw) create "direct"
+(direct-rw) open "direct"
+(direct-rw) write "direct"
+(direct-rw) open_direct "direct"
+(direct-rw) verified contents of "direct"
+(direct-rw) close "direct"
+(direct-rw) seek "direct" to 0
+(direct-rw) write "direct" directly
+(direct-rw) close "direct"
+(direct-rw) open "direct" for verification
+(direct-rw) verified contents of "direct"
+(direct-rw) close "direct"
+(direct-rw) open_direct "direct"
+(direct-rw) seek "direct" to 300
+(direct-rw) write 1000 bytes to "direct" directly
+(direct-rw) close "direct"
+(direct-rw) open "direct" for verification
+(direct-rw) verified contents of "direct"
+(direct-rw) close "direct"
+(direct-rw) end
+EOF
+pass;
@@ -0,0 +1,14 @@
+/* Tries to fsync an invalid fd, which must either fail silently
+   or terminate with exit code -1. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void) 
+{
+  msg ("fsync bad fd");
+  if (fsync (0x20101234))
+    fail ("fsync of bad fd succeeded");
+}
@@ -0,0 +1,15 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF', <<'EOF']);
+(fsync-bad-fd) begin
+(fsync-bad-fd) fsync bad fd
+(fsync-bad-fd) end
+fsync-bad-fd: exit(0)
+EOF
+(fsync-bad-fd) begin
+(fsync-bad-fd) fsync bad fd
+fsync-bad-fd: exit(-1)
+EOF
+pass;
@@ -0,0 +1,28 @@
+/* Writes a file, forces it to disk with fsync(), and checks that
+   its contents are still right afterward. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_SIZE 5678
+static char buf[FILE_SIZE];
+
+void
+test_main (void) 
+{
+  int fd;
+
+  random_init (0);
+  random_bytes (buf, sizeof buf);
+
+  CHECK (create ("syncme", 0), "create \"syncme\"");
+  CHECK ((fd = open ("syncme")) > 1, "open \"syncme\"");
+  CHECK (write (fd, buf, sizeof buf) == sizeof buf, "write \"syncme\"");
+  CHECK (fsync (fd), "fsync \"syncme\"");
+  CHECK (fsync (fd), "fsync \"syncme\" again");
+  msg ("close \"syncme\"");
+  close (fd);
+  check_file ("syncme", buf, sizeof buf);
+}
@@ -0,0 +1,18 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(fsync) begin
+(fsync) create "syncme"
+(fsync) open "syncme"
+(fsync) write "syncme"
+(fsync) fsync "syncme"
+(fsync) fsync "syncme" again
+(fsync) close "syncme"
+(fsync) open "syncme" for verification
+(fsync) verified contents of "syncme"
+(fsync) close "syncme"
+(fsync) end
+EOF
+pass;
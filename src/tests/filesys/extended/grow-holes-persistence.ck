@@ -0,0 +1,12 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+my ($holes) = "\0" x (79 * 2048 + 300);
+for my $i (0...79) {
+    substr ($holes, $i * 2048 + 100, 200) = random_bytes (200);
+}
+substr ($holes, 40 * 2048 + 812, 1000) = random_bytes (1000);
+check_archive ({"holes" => [$holes]});
+pass;
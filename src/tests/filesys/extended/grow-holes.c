@@ -0,0 +1,70 @@
+/* Writes a file in small pieces with holes between them, enough
+   that its extents don't all fit in the inode, then writes part of
+   a hole in the middle of the extent chain. The holes, and what
+   each write leaves of the sectors it covers in part, must read
+   back as zeros, not what the sectors held for a file removed
+   before. */
+
+#include <random.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+/* Piece I is PIECE_SIZE bytes at I * PIECE_STEP + PIECE_OFS */
+#define PIECE_CNT 80
+#define PIECE_STEP 2048
+#define PIECE_OFS 100
+#define PIECE_SIZE 200
+#define FILE_SIZE ((PIECE_CNT - 1) * PIECE_STEP + PIECE_OFS + PIECE_SIZE)
+
+/* Written last, over most of the hole after piece 40 */
+#define FILL_OFS (40 * PIECE_STEP + 812)
+#define FILL_SIZE 1000
+
+static char buf[FILE_SIZE];
+static char junk[FILE_SIZE];
+
+void
+test_main (void) 
+{
+  const char *file_name = "holes";
+  size_t i;
+  int fd;
+
+  /* Leave something other than zeros in the sectors "holes" may
+     get */
+  memset (junk, 0xcc, sizeof junk);
+  CHECK (create ("junk", 0), "create \"junk\"");
+  CHECK ((fd = open ("junk")) > 1, "open \"junk\"");
+  CHECK (write (fd, junk, sizeof junk) == sizeof junk, "write \"junk\"");
+  CHECK (fsync (fd), "fsync \"junk\"");
+  msg ("close \"junk\"");
+  close (fd);
+  CHECK (remove ("junk"), "remove \"junk\"");
+
+  random_init (0);
+  memset (buf, 0, sizeof buf);
+  for (i = 0; i < PIECE_CNT; i++)
+    random_bytes (buf + i * PIECE_STEP + PIECE_OFS, PIECE_SIZE);
+  random_bytes (buf + FILL_OFS, FILL_SIZE);
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  msg ("write %d pieces to \"%s\"", PIECE_CNT, file_name);
+  for (i = 0; i < PIECE_CNT; i++)
+    {
+      size_t ofs = i * PIECE_STEP + PIECE_OFS;
+
+      seek (fd, ofs);
+      if (write (fd, buf + ofs, PIECE_SIZE) != PIECE_SIZE)
+        fail ("write of piece %zu to \"%s\" failed", i, file_name);
+    }
+  msg ("seek \"%s\" to %d", file_name, FILL_OFS);
+  seek (fd, FILL_OFS);
+  CHECK (write (fd, buf + FILL_OFS, FILL_SIZE) == FILL_SIZE,
+         "write %d bytes to \"%s\"", FILL_SIZE, file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+  check_file (file_name, buf, sizeof buf);
+}
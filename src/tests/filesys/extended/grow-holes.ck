@@ -0,0 +1,24 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(grow-holes) begin
+(grow-holes) create "junk"
+(grow-holes) open "junk"
+(grow-holes) write "junk"
+(grow-holes) fsync "junk"
+(grow-holes) close "junk"
+(grow-holes) remove "junk"
+(grow-holes) create "holes"
+(grow-holes) open "holes"
+(grow-holes) write 80 pieces to "holes"
+(grow-holes) seek "holes" to 82732
+(grow-holes) write 1000 bytes to "holes"
+(grow-holes) close "holes"
+(grow-holes) open "holes" for verification
+(grow-holes) verified contents of "holes"
+(grow-holes) close "holes"
+(grow-holes) end
+EOF
+pass;
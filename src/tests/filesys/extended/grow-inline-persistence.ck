@@ -0,0 +1,9 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+my ($inline) = random_bytes (2000);
+my ($small) = substr (random_bytes (400), 0, 100) . "\0" x 350;
+check_archive ({"inline" => [$inline], "small" => [$small]});
+pass;
@@ -0,0 +1,49 @@
+/* Grows a file small enough to be kept inside its inode past that
+   size, checking its contents before and after it has to move out
+   to data sectors of its own. Then shrinks another one kept in its
+   inode and grows it back, which must bring back zeros, not the
+   bytes cut off. */
+
+#include <random.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[2000];
+static char small[450];
+
+void
+test_main (void) 
+{
+  const char *file_name = "inline";
+  int fd;
+
+  random_init (0);
+  random_bytes (buf, sizeof buf);
+  random_bytes (small, 400);
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK (write (fd, buf, 300) == 300, "write 300 bytes to \"%s\"",
+         file_name);
+  check_file (file_name, buf, 300);
+  CHECK (write (fd, buf + 300, 400) == 400, "write 400 bytes to \"%s\"",
+         file_name);
+  check_file (file_name, buf, 700);
+  CHECK (write (fd, buf + 700, 1300) == 1300,
+         "write 1300 bytes to \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+  check_file (file_name, buf, sizeof buf);
+
+  CHECK (create ("small", 0), "create \"small\"");
+  CHECK ((fd = open ("small")) > 1, "open \"small\"");
+  CHECK (write (fd, small, 400) == 400, "write 400 bytes to \"small\"");
+  CHECK (ftruncate (fd, 100), "ftruncate \"small\" to 100");
+  CHECK (ftruncate (fd, 450), "ftruncate \"small\" to 450");
+  memset (small + 100, 0, sizeof small - 100);
+  msg ("close \"small\"");
+  close (fd);
+  check_file ("small", small, sizeof small);
+}
@@ -0,0 +1,33 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(grow-inline) begin
+(grow-inline) create "inline"
+(grow-inline) open "inline"
+(grow-inline) write 300 bytes to "inline"
+(grow-inline) open "inline" for verification
+(grow-inline) verified contents of "inline"
+(grow-inline) close "inline"
+(grow-inline) write 400 bytes to "inline"
+(grow-inline) open "inline" for verification
+(grow-inline) verified contents of "inline"
+(grow-inline) close "inline"
+(grow-inline) write 1300 bytes to "inline"
+(grow-inline) close "inline"
+(grow-inline) open "inline" for verification
+(grow-inline) verified contents of "inline"
+(grow-inline) close "inline"
+(grow-inline) create "small"
+(grow-inline) open "small"
+(grow-inline) write 400 bytes to "small"
+(grow-inline) ftruncate "small" to 100
+(grow-inline) ftruncate "small" to 450
+(grow-inline) close "small"
+(grow-inline) open "small" for verification
+(grow-inline) verified contents of "small"
+(grow-inline) close "small"
+(grow-inline) end
+EOF
+pass;
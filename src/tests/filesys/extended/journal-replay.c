@@ -0,0 +1,58 @@
+/* Writes a file, syncs it, removes it and writes another over the
+   sectors it freed, syncing that too, then powers off without
+   writing back the cache or the journal, as if the machine
+   crashed. The second file must come back from the journal on the
+   next boot, without what the log holds of the first one written
+   over it. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_SIZE 20000
+static char buf_a[FILE_SIZE];
+static char buf_b[FILE_SIZE];
+
+/* Makes FILE_NAME, already there, durable */
+static void
+sync_file (const char *file_name) 
+{
+  int fd;
+
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK (fsync (fd), "fsync \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+}
+
+/* Creates FILE_NAME, writes BUF to it and syncs it */
+static void
+write_file (const char *file_name, const char *buf, size_t size) 
+{
+  int fd;
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK (write (fd, buf, size) == (int) size, "write \"%s\"", file_name);
+  CHECK (fsync (fd), "fsync \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+}
+
+void
+test_main (void) 
+{
+  random_init (0);
+  random_bytes (buf_a, sizeof buf_a);
+  random_bytes (buf_b, sizeof buf_b);
+
+  /* The files put here before the test ran must survive too */
+  sync_file ("tar");
+  sync_file ("journal-replay");
+
+  write_file ("a", buf_a, sizeof buf_a);
+  CHECK (remove ("a"), "remove \"a\"");
+  write_file ("b", buf_b, sizeof buf_b);
+  check_file ("b", buf_b, sizeof buf_b);
+}
@@ -0,0 +1,29 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(journal-replay) begin
+(journal-replay) open "tar"
+(journal-replay) fsync "tar"
+(journal-replay) close "tar"
+(journal-replay) open "journal-replay"
+(journal-replay) fsync "journal-replay"
+(journal-replay) close "journal-replay"
+(journal-replay) create "a"
+(journal-replay) open "a"
+(journal-replay) write "a"
+(journal-replay) fsync "a"
+(journal-replay) close "a"
+(journal-replay) remove "a"
+(journal-replay) create "b"
+(journal-replay) open "b"
+(journal-replay) write "b"
+(journal-replay) fsync "b"
+(journal-replay) close "b"
+(journal-replay) open "b" for verification
+(journal-replay) verified contents of "b"
+(journal-replay) close "b"
+(journal-replay) end
+EOF
+pass;
@@ -0,0 +1,9 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+my ($a) = random_bytes (80000);
+my ($b) = random_bytes (80000);
+check_archive ({"big" => [$b]});
+pass;
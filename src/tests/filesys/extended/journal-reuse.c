@@ -0,0 +1,57 @@
+/* Writes a file larger than a journal transaction holds in one
+   write, frees and reuses its sectors several times over, and
+   checks that the last version is the one that survives. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_SIZE 80000
+static char buf_a[FILE_SIZE];
+static char buf_b[FILE_SIZE];
+
+/* Creates FILE_NAME and writes BUF to it in a single write */
+static void
+write_file (const char *file_name, const char *buf, size_t size) 
+{
+  int fd;
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK (write (fd, buf, size) == (int) size, "write \"%s\"", file_name);
+  CHECK (fsync (fd), "fsync \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+}
+
+void
+test_main (void) 
+{
+  int i;
+
+  random_init (0);
+  random_bytes (buf_a, sizeof buf_a);
+  random_bytes (buf_b, sizeof buf_b);
+
+  write_file ("big", buf_a, sizeof buf_a);
+  check_file ("big", buf_a, sizeof buf_a);
+  CHECK (remove ("big"), "remove \"big\"");
+
+  msg ("create and remove \"tmp\" 10 times");
+  for (i = 0; i < 10; i++)
+    {
+      int fd;
+
+      if (!create ("tmp", 0) || (fd = open ("tmp")) < 2)
+        fail ("create \"tmp\" failed in round %d", i);
+      if (write (fd, buf_a, 5000) != 5000)
+        fail ("write \"tmp\" failed in round %d", i);
+      close (fd);
+      if (!remove ("tmp"))
+        fail ("remove \"tmp\" failed in round %d", i);
+    }
+
+  write_file ("big", buf_b, sizeof buf_b);
+  check_file ("big", buf_b, sizeof buf_b);
+}
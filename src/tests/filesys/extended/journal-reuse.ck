@@ -0,0 +1,27 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(journal-reuse) begin
+(journal-reuse) create "big"
+(journal-reuse) open "big"
+(journal-reuse) write "big"
+(journal-reuse) fsync "big"
+(journal-reuse) close "big"
+(journal-reuse) open "big" for verification
+(journal-reuse) verified contents of "big"
+(journal-reuse) close "big"
+(journal-reuse) remove "big"
+(journal-reuse) create and remove "tmp" 10 times
+(journal-reuse) create "big"
+(journal-reuse) open "big"
+(journal-reuse) write "big"
+(journal-reuse) fsync "big"
+(journal-reuse) close "big"
+(journal-reuse) open "big" for verification
+(journal-reuse) verified contents of "big"
+(journal-reuse) close "big"
+(journal-reuse) end
+EOF
+pass;
@@ -0,0 +1,27 @@
+/* Tries to truncate a nonexistent file, a directory, and to a
+   negative length, all of which must fail, then to ftruncate an
+   invalid fd, which must either fail silently or terminate with
+   exit code -1. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void) 
+{
+  int fd;
+
+  CHECK (!truncate ("no-such-file", 0),
+         "truncate \"no-such-file\" (must fail)");
+  CHECK (mkdir ("xyzzy"), "mkdir \"xyzzy\"");
+  CHECK (!truncate ("xyzzy", 0), "truncate \"xyzzy\" (must fail)");
+  CHECK ((fd = open ("xyzzy")) > 1, "open \"xyzzy\"");
+  CHECK (!ftruncate (fd, 0), "ftruncate \"xyzzy\" (must fail)");
+  CHECK (create ("file", 100), "create \"file\"");
+  CHECK (!truncate ("file", 0x80000000),
+         "truncate \"file\" to negative length (must fail)");
+  msg ("ftruncate bad fd");
+  if (ftruncate (0x20101234, 0))
+    fail ("ftruncate of bad fd succeeded");
+}
@@ -0,0 +1,29 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF', <<'EOF']);
+(trunc-bad) begin
+(trunc-bad) truncate "no-such-file" (must fail)
+(trunc-bad) mkdir "xyzzy"
+(trunc-bad) truncate "xyzzy" (must fail)
+(trunc-bad) open "xyzzy"
+(trunc-bad) ftruncate "xyzzy" (must fail)
+(trunc-bad) create "file"
+(trunc-bad) truncate "file" to negative length (must fail)
+(trunc-bad) ftruncate bad fd
+(trunc-bad) end
+trunc-bad: exit(0)
+EOF
+(trunc-bad) begin
+(trunc-bad) truncate "no-such-file" (must fail)
+(trunc-bad) mkdir "xyzzy"
+(trunc-bad) truncate "xyzzy" (must fail)
+(trunc-bad) open "xyzzy"
+(trunc-bad) ftruncate "xyzzy" (must fail)
+(trunc-bad) create "file"
+(trunc-bad) truncate "file" to negative length (must fail)
+(trunc-bad) ftruncate bad fd
+trunc-bad: exit(-1)
+EOF
+pass;
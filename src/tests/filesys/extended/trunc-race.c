@@ -0,0 +1,70 @@
+/* Truncates a file to different lengths over and over while
+   subprocesses write it. Whatever the file ends up holding must
+   be what they wrote or zeros, not the contents of sectors freed
+   by a truncate under a write, or those of a file removed
+   before. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/filesys/extended/trunc-race.h"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define CHILD_CNT 2
+
+static char junk[16 * 512];
+
+void
+test_main (void) 
+{
+  pid_t children[CHILD_CNT];
+  size_t ofs, size;
+  int fd;
+  int round;
+
+  /* Leave something other than zeros in the sectors the file may
+     get */
+  memset (junk, 0xcc, sizeof junk);
+  CHECK (create ("junk", 0), "create \"junk\"");
+  CHECK ((fd = open ("junk")) > 1, "open \"junk\"");
+  CHECK (write (fd, junk, sizeof junk) == sizeof junk, "write \"junk\"");
+  CHECK (fsync (fd), "fsync \"junk\"");
+  msg ("close \"junk\"");
+  close (fd);
+  CHECK (remove ("junk"), "remove \"junk\"");
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+
+  exec_children ("child-trunc-race", children, CHILD_CNT);
+
+  quiet = true;
+  for (round = 0; round < 2 * ROUND_CNT; round++)
+    CHECK (ftruncate (fd, round % 4 * CHUNK_SIZE),
+           "ftruncate \"%s\" to %d", file_name, round % 4 * CHUNK_SIZE);
+  quiet = false;
+
+  wait_children (children, CHILD_CNT);
+
+  size = filesize (fd);
+  CHECK (size <= RACE_SIZE, "filesize \"%s\" is at most %d",
+         file_name, RACE_SIZE);
+  msg ("seek \"%s\" to 0", file_name);
+  seek (fd, 0);
+  for (ofs = 0; ofs < size; ofs++)
+    {
+      char c;
+
+      if (read (fd, &c, 1) != 1)
+        fail ("read of byte %zu in \"%s\" failed", ofs, file_name);
+      if (c != 'x' && c != 0)
+        fail ("byte %zu in \"%s\" is 0x%02x, not 'x' or 0",
+              ofs, file_name, c & 0xff);
+    }
+  msg ("verified contents of \"%s\"", file_name);
+
+  /* Leave it in a known state for the persistence check */
+  CHECK (ftruncate (fd, 0), "ftruncate \"%s\" to 0", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+}
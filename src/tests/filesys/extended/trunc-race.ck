@@ -0,0 +1,26 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(trunc-race) begin
+(trunc-race) create "junk"
+(trunc-race) open "junk"
+(trunc-race) write "junk"
+(trunc-race) fsync "junk"
+(trunc-race) close "junk"
+(trunc-race) remove "junk"
+(trunc-race) create "racy"
+(trunc-race) open "racy"
+(trunc-race) exec child 1 of 2: "child-trunc-race 0"
+(trunc-race) exec child 2 of 2: "child-trunc-race 1"
+(trunc-race) wait for child 1 of 2 returned 0 (expected 0)
+(trunc-race) wait for child 2 of 2 returned 1 (expected 1)
+(trunc-race) filesize "racy" is at most 4096
+(trunc-race) seek "racy" to 0
+(trunc-race) verified contents of "racy"
+(trunc-race) ftruncate "racy" to 0
+(trunc-race) close "racy"
+(trunc-race) end
+EOF
+pass;
@@ -0,0 +1,9 @@
+#ifndef TESTS_FILESYS_EXTENDED_TRUNC_RACE_H
+#define TESTS_FILESYS_EXTENDED_TRUNC_RACE_H
+
+#define CHUNK_SIZE 700
+#define RACE_SIZE (8 * 512)
+#define ROUND_CNT 100
+static const char file_name[] = "racy";
+
+#endif /* tests/filesys/extended/trunc-race.h */
@@ -0,0 +1,7 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+check_archive ({"trunc" => [random_bytes (1000) . "\0" x 1000]});
+pass;
@@ -0,0 +1,38 @@
+/* Shrinks a file with ftruncate(), grows it again, and checks
+   that the bytes cut off come back as zeros rather than their old
+   contents. Then shrinks it by name with truncate(). */
+
+#include <random.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[5000];
+
+void
+test_main (void) 
+{
+  const char *file_name = "trunc";
+  int fd;
+
+  random_init (0);
+  random_bytes (buf, sizeof buf);
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK (write (fd, buf, sizeof buf) == sizeof buf,
+         "write \"%s\"", file_name);
+  CHECK (ftruncate (fd, 1000), "ftruncate \"%s\" to 1000", file_name);
+  CHECK (filesize (fd) == 1000, "filesize \"%s\" is 1000", file_name);
+  CHECK (ftruncate (fd, 3000), "ftruncate \"%s\" to 3000", file_name);
+  memset (buf + 1000, 0, sizeof buf - 1000);
+  msg ("seek \"%s\" to 0", file_name);
+  seek (fd, 0);
+  check_file_handle (fd, file_name, buf, 3000);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+
+  CHECK (truncate (file_name, 2000), "truncate \"%s\" to 2000", file_name);
+  check_file (file_name, buf, 2000);
+}
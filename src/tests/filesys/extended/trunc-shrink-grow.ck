@@ -0,0 +1,22 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(trunc-shrink-grow) begin
+(trunc-shrink-grow) create "trunc"
+(trunc-shrink-grow) open "trunc"
+(trunc-shrink-grow) write "trunc"
+(trunc-shrink-grow) ftruncate "trunc" to 1000
+(trunc-shrink-grow) filesize "trunc" is 1000
+(trunc-shrink-grow) ftruncate "trunc" to 3000
+(trunc-shrink-grow) seek "trunc" to 0
+(trunc-shrink-grow) verified contents of "trunc"
+(trunc-shrink-grow) close "trunc"
+(trunc-shrink-grow) truncate "trunc" to 2000
+(trunc-shrink-grow) open "trunc" for verification
+(trunc-shrink-grow) verified contents of "trunc"
+(trunc-shrink-grow) close "trunc"
+(trunc-shrink-grow) end
+EOF
+pass;
@@ -36,6 +36,7 @@
 #include "devices/ide.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
+#include "filesys/cache.h"
 #endif
 #if VM
 #include "vm/frame.h"
@@ -253,10 +254,27 @@ parse_options (char **argv)
 #ifdef FILESYS
       else if (!strcmp (name, "-f"))
         format_filesys = true;
+      else if (!strcmp (name, "-crash"))
+        shutdown_configure (SHUTDOWN_CRASH);
       else if (!strcmp (name, "-filesys"))
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-flush-age"))
+        {
+          if (!cache_set_flush_age (atoi (value)))
+            PANIC ("flush age \"%s\" out of range (use -h for help)", value);
+        }
+      else if (!strcmp (name, "-cache"))
+        {
+          if (!cache_set_size (atoi (value)))
+            PANIC ("cache size \"%s\" out of range (use -h for help)", value);
+        }
+      else if (!strcmp (name, "-cache-policy"))
+        {
+          if (!cache_set_policy (value))
+            PANIC ("unknown cache policy \"%s\" (use -h for help)", value);
+        }
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
@@ -381,8 +399,12 @@ usage (void)
           "  -r                 Reboot after actions.\n"
 #ifdef FILESYS
           "  -f                 Format file system device during startup.\n"
+          "  -crash             Like -q, without writing back the file system.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -flush-age=TICKS   Write back data dirty for TICKS (1 to 6000).\n"
+          "  -cache=N           Cache N disk sectors in memory (32 to 1024).\n"
+          "  -cache-policy=POL  Replace cache entries by POL: fifo, clock, lru, 2q.\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
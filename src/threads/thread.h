@@ -132,6 +132,8 @@ struct thread
 #ifdef FILESYS
     block_sector_t dir_sector;          /* Inode for current dir is saved in here */
     bool dir_removed;                   /* Dir removed */
+    int journal_depth;                  /* Nesting of journal handles */
+    int journal_credits;                /* Sectors its handle may log */
 #endif
     
     /* Owned by thread.c. */
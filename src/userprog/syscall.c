@@ -30,6 +30,7 @@
 #include "filesys/inode.h"
 #include "stddef.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
 #endif
 
 static void syscall_handler (struct intr_frame *);
@@ -62,6 +63,13 @@ static bool mkdir (const char *dir);
 static bool readdir (int fd, char *name);
 static bool isdir (int fd);
 static int inumber (int fd);
+static bool fsync (int fd);
+static int open_direct (const char *file);
+static bool truncate (const char *file, unsigned length);
+static bool ftruncate (int fd, unsigned length);
+#ifdef VM
+static int write_direct (struct file *, const void *, unsigned);
+#endif
 #define READDIR_MAX_LEN 50
 #endif
 
@@ -230,6 +238,28 @@ syscall_handler (struct intr_frame *f UNUSED)
       fd = (int) argv[0];
       f->eax = inumber (fd);
       break;
+    case SYS_FSYNC:
+      read_arguments (f->esp, &argv[0], 1, f);
+      fd = (int) argv[0];
+      f->eax = fsync (fd);
+      break;
+    case SYS_OPEN_DIRECT:
+      read_arguments (f->esp, &argv[0], 1, f);
+      file = (const char *) argv[0];
+      valid_address ((void *) file, f);
+      f->eax = open_direct (file);
+      break;
+    case SYS_TRUNCATE:
+      read_arguments (f->esp, &argv[0], 2, f);
+      file = (const char *) argv[0];
+      valid_address ((void *) file, f);
+      f->eax = truncate (file, (unsigned) argv[1]);
+      break;
+    case SYS_FTRUNCATE:
+      read_arguments (f->esp, &argv[0], 2, f);
+      fd = (int) argv[0];
+      f->eax = ftruncate (fd, (unsigned) argv[1]);
+      break;
 #endif
     default:
       printf ("sysnum : default\n");
@@ -405,6 +435,12 @@ write (int fd, const void *buffer, unsigned size)
       {
         return -1;
       }
+#ifdef VM
+      if (file_is_direct (f))
+      {
+        return write_direct (f, buffer, size);
+      }
+#endif
       int result = (int) file_write (f, buffer, (off_t) size);
       //lock_release (&file_lock);
       return result;
@@ -849,18 +885,18 @@ munmap (mapid_t mapid)
     if (spte->location == LOC_PM)
     {
       /* If the given page is dirty, then write it to filesys */
+      struct fte *fte = find_fte_by_spte (spte);
       if (pagedir_is_dirty (thread_current ()->pagedir, spte->addr))
       {
         lock_acquire (&frame_lock);
         struct file *file = spte->file;
-        void *addr = spte->addr;
         off_t size = spte->read_bytes;
         off_t ofs = spte->ofs;
-        file_write_at (file, addr, size, ofs);
+        /* Write the frame straight to disk, bypassing the buffer cache */
+        inode_write_direct_at (file_get_inode (file), fte->frame, size, ofs);
         lock_release (&frame_lock);
       }
       /* Remove it from frame table */
-      struct fte *fte = find_fte_by_spte (spte);
       list_remove (&fte->elem);
       /* Remove mapping from user virtual to kernel virtual (physical) */
       pagedir_clear_page (thread_current ()->pagedir, spte->addr);
@@ -877,13 +913,32 @@ munmap (mapid_t mapid)
         {
           lock_acquire (&swap_lock);
           struct file *file = spte->file;
-          void *buffer = (void *) malloc (BLOCK_SECTOR_SIZE);
-          int i=0;
-          for (; i<8; i++)
+          void *buffer = palloc_get_page (0);
+          if (buffer != NULL)
           {
-            block_read (swap_block, swap_index + i, buffer);
-            file_write_at (file, buffer, BLOCK_SECTOR_SIZE, ofs + BLOCK_SECTOR_SIZE * i);
-            buffer += BLOCK_SECTOR_SIZE;
+            /* Move the whole page from swap to the file at once */
+            block_read_multiple (swap_block, swap_index, buffer, PGSIZE / BLOCK_SECTOR_SIZE);
+            inode_write_direct_at (file_get_inode (file), buffer, spte->read_bytes, ofs);
+            palloc_free_page (buffer);
+          }
+          else
+          {
+            /* No page to spare, go a sector at a time through a
+               buffer that swap_lock protects */
+            static uint8_t sector_buf[BLOCK_SECTOR_SIZE];
+            off_t done;
+            for (done = 0; done < (off_t) spte->read_bytes;
+                 done += BLOCK_SECTOR_SIZE)
+            {
+              off_t chunk = (off_t) spte->read_bytes - done;
+              if (chunk > BLOCK_SECTOR_SIZE)
+              {
+                chunk = BLOCK_SECTOR_SIZE;
+              }
+              block_read (swap_block, swap_index + done / BLOCK_SECTOR_SIZE,
+                          sector_buf);
+              file_write_at (file, sector_buf, chunk, ofs + done);
+            }
           }
           /* Update swap sector bitmap */
           bitmap_set_multiple (swap_bm, swap_index, 8, false);
@@ -1054,8 +1109,18 @@ static bool mkdir (const char *dir)
     return false;
   }
  
+  /* New directories are spread out over the emptiest block groups.
+   * Making it and adding it is one journal transaction. */
+  journal_begin (JOURNAL_CREATE, true);
   block_sector_t sector;
-  free_map_allocate (1, &sector);
+  if (!free_map_allocate_near (1, free_map_spread_goal (), &sector))
+  {
+    /* Disk full */
+    dir_close (directory);
+    journal_end ();
+    free (last_name);
+    return false;
+  }
   
   //printf ("before create dir\n");
   /* Directory creation succeed */ 
@@ -1073,6 +1138,7 @@ static bool mkdir (const char *dir)
       free_map_release (sector, 1);
       dir_close (directory); 
       dir_close (new_dir);
+      journal_end ();
       free (last_name);
       return false;
     }
@@ -1094,11 +1160,13 @@ static bool mkdir (const char *dir)
     //printf ("mkdir failed..\n");
     free_map_release (sector, 1);
     dir_close (directory);
+    journal_end ();
     free (last_name);
     return false;
   }
   //printf ("the directory should be root, %d\n", dir_get_inode (directory)->sector);
   dir_close (directory);
+  journal_end ();
   free (last_name);
   return true;
 }
@@ -1160,4 +1228,98 @@ static int inumber (int fd)
   int inumber = inode_get_inumber (file_get_inode (f));
   return inumber;
 }
+
+/* Writes the cached data of the file FD to disk */
+static bool fsync (int fd)
+{
+  struct filedescriptor *filedes = find_file (fd);
+
+  if (filedes == NULL)
+  {
+    exit (-1);
+  }
+
+  file_sync (filedes->file);
+  return true;
+}
+
+/* Opens FILE like open, but reads and writes of whole sectors on
+   the new fd bypass the buffer cache */
+static int open_direct (const char *file)
+{
+  int fd = open (file);
+
+  if (fd != -1)
+  {
+    file_set_direct (find_file (fd)->file, true);
+  }
+  return fd;
+}
+
+/* Sets the size of FILE to LENGTH bytes, see file_truncate().
+   Directories can't be truncated. */
+static bool truncate (const char *file, unsigned length)
+{
+  struct file *f;
+  bool success;
+
+  if ((off_t) length < 0 || (f = filesys_open (file)) == NULL)
+  {
+    return false;
+  }
+  success = file_get_inode (f)->type != INODE_DIR
+            && file_truncate (f, length);
+  file_close (f);
+  return success;
+}
+
+/* Sets the size of the file FD to LENGTH bytes */
+static bool ftruncate (int fd, unsigned length)
+{
+  struct filedescriptor *filedes = find_file (fd);
+
+  if (filedes == NULL)
+  {
+    exit (-1);
+  }
+  if ((off_t) length < 0
+      || file_get_inode (filedes->file)->type == INODE_DIR)
+  {
+    return false;
+  }
+  return file_truncate (filedes->file, length);
+}
+
+#ifdef VM
+/* Writes to a direct file F. BUFFER may be paged out and must not
+   fault while the disk is busy with it, so copy it through a
+   kernel page a page at a time */
+static int write_direct (struct file *f, const void *buffer, unsigned size)
+{
+  void *kpage = palloc_get_page (0);
+  int result = 0;
+
+  /* No page to spare, go through the cache instead */
+  if (kpage == NULL)
+  {
+    return (int) file_write_cached (f, buffer, (off_t) size);
+  }
+  while (size > 0)
+  {
+    unsigned chunk = size < PGSIZE ? size : PGSIZE;
+    off_t written;
+
+    memcpy (kpage, buffer + result, chunk);
+    written = file_write (f, kpage, (off_t) chunk);
+    result += written;
+    size -= chunk;
+    if (written != (off_t) chunk)
+    {
+      break;
+    }
+  }
+  palloc_free_page (kpage);
+  return result;
+}
+#endif
 #endif